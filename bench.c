@@ -0,0 +1,409 @@
+#include "opshell.h"
+
+// Microbenchmarks for the shell's hot paths. Results go to stdout as one
+// JSON document so runs can be archived and compared across builds:
+//
+//   opshell_bench [--quick] > bench.json
+
+#define BENCH_TREE_FILES 256
+#define BENCH_FILE_SIZE (64 * 1024)
+#define BENCH_PATTERNS 200
+
+struct BenchResult {
+    const char *name;
+    long iterations;
+    double nsPerOp;
+    double p50Us;               // Latency percentiles; < 0 when not measured
+    double p99Us;
+    double mbPerSec;            // Throughput; < 0 when not measured
+};
+
+struct BenchResult results[32];
+int numResults = 0;
+int quick = 0;
+
+double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+struct BenchResult *addResult(const char *name, long iterations, double totalNs) {
+    struct BenchResult *result = &results[numResults++];
+    result->name = name;
+    result->iterations = iterations;
+    result->nsPerOp = totalNs / iterations;
+    result->p50Us = -1;
+    result->p99Us = -1;
+    result->mbPerSec = -1;
+    return result;
+}
+
+// Representative interactive and scripted command lines
+const char *benchLines[] = {
+        "ls -la /tmp",
+        "search -r -j 4 \"executeCommand\"",
+        "grep -n TODO main.c | sort | uniq -c > todo.txt",
+        "bookmark \"make -j8 all\"",
+        "cc -O2 -Wall -Wextra -o build/out/shell main.c bench.c -lpthread 2> errors.log &",
+};
+
+void benchTokenize() {
+    long iterations = quick ? 100000 : 1000000;
+    int numLines = sizeof(benchLines) / sizeof(benchLines[0]);
+    char buffer[256];
+    long tokens = 0;
+
+    double start = nowNs();
+    for (long i = 0; i < iterations; i++) {
+        const char *line = benchLines[i % numLines];
+        size_t len = strlen(line);
+        memcpy(buffer, line, len + 1);
+        int background = 0;
+        char **args = setup(buffer, len, &background);
+        while (*args++ != NULL) {
+            tokens++;
+        }
+        arenaReset(&commandArena);
+    }
+    addResult("tokenize_line", iterations, nowNs() - start);
+    if (tokens == 0) {
+        fprintf(stderr, "tokenize produced no tokens\n");
+    }
+}
+
+void benchResolve() {
+    long iterations = quick ? 100000 : 1000000;
+    const char *names[] = {"ls", "cat", "grep", "sort", "no-such-command"};
+
+    // Warm: every name is already cached, hits and misses alike
+    double start = nowNs();
+    for (long i = 0; i < iterations; i++) {
+        lookupCommandPath(names[i % 5]);
+    }
+    addResult("resolve_cached", iterations, nowNs() - start);
+
+    // Cold: the PATH walk every launch used to pay
+    long coldIterations = iterations / 100;
+    start = nowNs();
+    for (long i = 0; i < coldIterations; i++) {
+        resetCommandCache();
+        lookupCommandPath(names[i % 5]);
+    }
+    addResult("resolve_uncached", coldIterations, nowNs() - start);
+}
+
+// Round trip of starting /bin/true and reaping it, through each launch path
+void benchLaunch(const char *name, int useFork) {
+    long iterations = quick ? 200 : 2000;
+    double *samples = malloc(iterations * sizeof(double));
+    char *args[] = {"true", NULL};
+    const char *commandPath = lookupCommandPath("true");
+    if (commandPath == NULL) {
+        fprintf(stderr, "true not found on PATH; skipping %s\n", name);
+        free(samples);
+        return;
+    }
+
+    forceForkLaunch = useFork;
+    double total = 0;
+    for (long i = 0; i < iterations; i++) {
+        struct LaunchRequest request = {commandPath, args, NULL, 0, 0, -1, -1, -1, 0};
+        double start = nowNs();
+        pid_t pid = launchCommand(&request);
+        int status;
+        waitpid(pid, &status, 0);
+        samples[i] = nowNs() - start;
+        total += samples[i];
+    }
+    forceForkLaunch = 0;
+
+    qsort(samples, iterations, sizeof(double), compareDoubles);
+    struct BenchResult *result = addResult(name, iterations, total);
+    result->p50Us = samples[iterations / 2] / 1e3;
+    result->p99Us = samples[iterations * 99 / 100] / 1e3;
+    free(samples);
+}
+
+// The launch paths again from a parent with a large, touched heap, the
+// way a long-running shell grows: fork copies its page tables on every
+// launch, while spawn should not care
+void benchLaunchLarge() {
+    size_t size = (size_t) (quick ? 64 : 512) << 20;
+    char *ballast = malloc(size);
+    if (ballast == NULL) {
+        return;
+    }
+    memset(ballast, 1, size);
+    benchLaunch("launch_spawn_large", 0);
+    benchLaunch("launch_fork_large", 1);
+    free(ballast);
+}
+
+// The same command run in the shell's own process, as scripts now get it
+void benchBuiltin() {
+    long iterations = quick ? 100000 : 1000000;
+    char *args[] = {"true", NULL};
+    double start = nowNs();
+    for (long i = 0; i < iterations; i++) {
+        runCommand(args, 0);
+    }
+    addResult("builtin_true", iterations, nowNs() - start);
+}
+
+// Index a synthetic history log the size of years of use, then time the
+// reverse-search query that runs on every keystroke of Ctrl-R
+void benchHistory() {
+    char path[] = "/tmp/opshell_history.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+    setenv("OPSHELL_HISTORY", path, 1);
+    loadHistory();
+
+    const char *commands[] = {"git commit -m", "make -j8 target", "grep -rn pattern src/", "ssh build-host",
+                              "cd project", "ls -la dir", "vim notes"};
+    long entries = quick ? 100000 : 1000000;
+    char line[128];
+    for (long i = 0; i < entries; i++) {
+        snprintf(line, sizeof(line), "%s%ld", commands[i % 7], (i * 7919) % (entries / 10));
+        addHistory(line, 0, 0, 0);
+        arenaReset(&commandArena);
+    }
+    double start = nowNs();
+    refreshHistory();
+    addResult("history_index", entries, nowNs() - start);
+
+    // Substring queries of growing length, as typed
+    const char *queries[] = {"g", "gr", "grep", "src/12", "make -j8 target99", "no such command"};
+    long iterations = quick ? 200 : 1000;
+    double *samples = malloc(iterations * sizeof(double));
+    double total = 0;
+    for (long i = 0; i < iterations; i++) {
+        double begin = nowNs();
+        findHistoryEntry(queries[i % 6], historyStore.count, 0);
+        samples[i] = nowNs() - begin;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(double), compareDoubles);
+    struct BenchResult *result = addResult("history_search", iterations, total);
+    result->p50Us = samples[iterations / 2] / 1e3;
+    result->p99Us = samples[iterations * 99 / 100] / 1e3;
+    free(samples);
+    unlink(path);
+}
+
+// Tab completion against a $PATH with 10k executables: build the trie,
+// then complete prefixes from ambiguous to unique
+void benchComplete() {
+    const char *stems[] = {"git", "gcc", "python3", "x86_64-linux-gnu-", "kube", "perl", "lib", "z"};
+    struct Trie trie;
+    char name[64];
+    double start = nowNs();
+    initTrie(&trie);
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "%s%s%d", stems[i % 8], i % 3 ? "-tool" : "", i);
+        insertTrieWord(&trie, name);
+    }
+    addResult("complete_build", 10000, nowNs() - start);
+
+    const char *prefixes[] = {"g", "git-tool1", "x86_64-linux-gnu-", "python3-tool97", "kube9992", "nothing"};
+    long iterations = quick ? 2000 : 20000;
+    double *samples = malloc(iterations * sizeof(double));
+    double total = 0;
+    for (long i = 0; i < iterations; i++) {
+        struct Completions found = {arenaAlloc(&commandArena, EDITOR_LIST_MAX * sizeof(char *)), 0, 0, NULL};
+        double begin = nowNs();
+        completeFromTrie(&trie, prefixes[i % 6], &found);
+        samples[i] = nowNs() - begin;
+        total += samples[i];
+        arenaReset(&commandArena);
+    }
+    qsort(samples, iterations, sizeof(double), compareDoubles);
+    struct BenchResult *result = addResult("complete_command", iterations, total);
+    result->p50Us = samples[iterations / 2] / 1e3;
+    result->p99Us = samples[iterations * 99 / 100] / 1e3;
+    free(samples);
+    freeTrie(&trie);
+}
+
+// Pseudo-C source with a sprinkling of the identifier the search looks for
+void fillSyntheticSource(char *buf, size_t size, unsigned seed) {
+    const char *lines[] = {
+            "    for (int i = 0; i < count; i++) {\n",
+            "        total += values[i] * weights[i];\n",
+            "    }\n",
+            "static int helperFunction(struct Context *ctx, const char *name);\n",
+            "    if (ctx->flags & FLAG_VERBOSE) printf(\"%s\\n\", name);\n",
+            "    // TODO: handle the error path properly\n",
+            "#include <stdio.h>\n",
+    };
+    size_t pos = 0;
+    while (pos < size) {
+        seed = seed * 1103515245 + 12345;
+        const char *line = (seed >> 16) % 997 == 0 ? "    benchNeedle(ctx);\n" : lines[(seed >> 16) % 7];
+        size_t len = strlen(line);
+        if (pos + len > size) {
+            len = size - pos;
+        }
+        memcpy(buf + pos, line, len);
+        pos += len;
+    }
+}
+
+void benchSearch() {
+    char root[] = "/tmp/opshell_bench.XXXXXX";
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+
+    int numFiles = quick ? BENCH_TREE_FILES / 8 : BENCH_TREE_FILES;
+    char *buf = malloc(BENCH_FILE_SIZE);
+    char path[MAX_PATH];
+    for (int i = 0; i < numFiles; i++) {
+        fillSyntheticSource(buf, BENCH_FILE_SIZE, i);
+        snprintf(path, sizeof(path), "%s/file%03d.c", root, i);
+        FILE *file = fopen(path, "w");
+        fwrite(buf, 1, BENCH_FILE_SIZE, file);
+        fclose(file);
+    }
+
+    char *needle[] = {"benchNeedle"};
+    struct SearchMatcher matcher;
+    compileSearchMatcher(needle, 1, &matcher);
+
+    // The in-memory kernel alone
+    struct SearchTask kernelTask = {0};
+    kernelTask.name = "bench";
+    long kernelIterations = quick ? 200 : 2000;
+    double start = nowNs();
+    for (long i = 0; i < kernelIterations; i++) {
+        kernelTask.output.len = 0;
+        searchBuffer(buf, BENCH_FILE_SIZE, &matcher, &kernelTask);
+    }
+    struct BenchResult *result = addResult("search_kernel", kernelIterations, nowNs() - start);
+    result->mbPerSec = (double) BENCH_FILE_SIZE * kernelIterations / (result->nsPerOp * kernelIterations / 1e9) / 1e6;
+
+    // A banned-symbol list: BENCH_PATTERNS identifiers through one automaton
+    char *patterns[BENCH_PATTERNS];
+    for (int i = 0; i < BENCH_PATTERNS - 1; i++) {
+        patterns[i] = malloc(32);
+        snprintf(patterns[i], 32, "deprecatedApi%03d", i);
+    }
+    patterns[BENCH_PATTERNS - 1] = "benchNeedle";
+    struct SearchMatcher multi;
+    compileSearchMatcher(patterns, BENCH_PATTERNS, &multi);
+    start = nowNs();
+    for (long i = 0; i < kernelIterations; i++) {
+        kernelTask.output.len = 0;
+        searchBuffer(buf, BENCH_FILE_SIZE, &multi, &kernelTask);
+    }
+    result = addResult("search_kernel_multi", kernelIterations, nowNs() - start);
+    result->mbPerSec = (double) BENCH_FILE_SIZE * kernelIterations / (result->nsPerOp * kernelIterations / 1e9) / 1e6;
+    freeSearchMatcher(&multi);
+    for (int i = 0; i < BENCH_PATTERNS - 1; i++) {
+        free(patterns[i]);
+    }
+
+    // Whole files: open, map or read, scan, close
+    struct SearchTask *tasks = calloc(numFiles, sizeof(struct SearchTask));
+    for (int i = 0; i < numFiles; i++) {
+        snprintf(path, sizeof(path), "%s/file%03d.c", root, i);
+        tasks[i].name = strdup(path);
+    }
+    int rounds = quick ? 2 : 10;
+    start = nowNs();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < numFiles; i++) {
+            tasks[i].output.len = 0;
+            searchInFile(&tasks[i], &matcher);
+        }
+    }
+    double elapsed = nowNs() - start;
+    result = addResult("search_files", (long) rounds * numFiles, elapsed);
+    result->mbPerSec = (double) BENCH_FILE_SIZE * numFiles * rounds / (elapsed / 1e9) / 1e6;
+
+#ifdef SEARCH_URING
+    // Same files, batched through one io_uring the way a scanner drives it
+    struct SearchRing ring;
+    if (searchUringSupported() && openSearchRing(&ring, 2 * SEARCH_URING_BATCH) == 0) {
+        struct SearchTask *batch[SEARCH_URING_BATCH];
+        start = nowNs();
+        for (int r = 0; r < rounds; r++) {
+            for (int i = 0; i < numFiles; i += SEARCH_URING_BATCH) {
+                int count = numFiles - i < SEARCH_URING_BATCH ? numFiles - i : SEARCH_URING_BATCH;
+                for (int k = 0; k < count; k++) {
+                    tasks[i + k].output.len = 0;
+                    batch[k] = &tasks[i + k];
+                }
+                searchBatchUring(&ring, batch, count, &matcher);
+            }
+        }
+        elapsed = nowNs() - start;
+        result = addResult("search_files_uring", (long) rounds * numFiles, elapsed);
+        result->mbPerSec = (double) BENCH_FILE_SIZE * numFiles * rounds / (elapsed / 1e9) / 1e6;
+        closeSearchRing(&ring);
+    }
+#endif
+
+    for (int i = 0; i < numFiles; i++) {
+        free(tasks[i].name);
+        free(tasks[i].path);
+        free(tasks[i].output.data);
+    }
+    free(tasks);
+    freeSearchMatcher(&matcher);
+    free(kernelTask.output.data);
+    free(kernelTask.path);
+    free(buf);
+    for (int i = 0; i < numFiles; i++) {
+        snprintf(path, sizeof(path), "%s/file%03d.c", root, i);
+        unlink(path);
+    }
+    rmdir(root);
+}
+
+void printResults() {
+    printf("{\n  \"timestamp\": %ld,\n  \"quick\": %s,\n  \"benchmarks\": [\n", (long) time(NULL),
+           quick ? "true" : "false");
+    for (int i = 0; i < numResults; i++) {
+        struct BenchResult *result = &results[i];
+        printf("    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f", result->name, result->iterations,
+               result->nsPerOp);
+        if (result->p50Us >= 0) {
+            printf(", \"p50_us\": %.1f, \"p99_us\": %.1f", result->p50Us, result->p99Us);
+        }
+        if (result->mbPerSec >= 0) {
+            printf(", \"mb_per_s\": %.1f", result->mbPerSec);
+        }
+        printf("}%s\n", i + 1 < numResults ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    benchTokenize();
+    benchResolve();
+    benchLaunch("launch_spawn", 0);
+    benchLaunch("launch_fork", 1);
+    benchLaunchLarge();
+    benchBuiltin();
+    benchHistory();
+    benchComplete();
+    benchSearch();
+    printResults();
+    return 0;
+}
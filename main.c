@@ -1,434 +1,6388 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <signal.h>
-#include <string.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <sys/stat.h>
-
-#define MAX_LINE 80
-#define MAX_BOOKMARKS 10
-#define MAX_PATH 256
-
-// Function declarations
-void setup(char inputBuffer[], char *args[], int *background);
-void executeCommand(char *args[], int background);
-void searchFiles(char *path, char *keyword, int recursive);
-void searchInFile(char *filename, char *keyword);
-int handleInternalCommands(char *args[]);
-void handleIOredirection(char *args[]);
-void handleBookmarkCommand(char *args[]);
-void printBookmarks();
-char* trimQuotes(const char *str);
-
-char *bookmarks[MAX_BOOKMARKS];
-int numBookmarks = 0;
-pid_t foregroundProcess = 0;
-
-void setup(char inputBuffer[], char *args[], int *background) {
-    int length, i, start, ct;
-    ct = 0;
-    length = read(STDIN_FILENO, inputBuffer, MAX_LINE);
-    start = -1;
-    if (length == 0)
+#include "opshell.h"
+
+struct BookmarkStore bookmarkStore;
+struct HistoryStore historyStore = {.fd = -1};
+struct LineEditor lineEditor;
+struct CommandCache commandCache;
+
+struct ChildEvent childEvents[CHILD_EVENT_RING];
+volatile sig_atomic_t childEventHead = 0;
+volatile sig_atomic_t childEventTail = 0;
+volatile sig_atomic_t childEventsDropped = 0;
+
+struct Job **jobs;
+int numJobs = 0;
+int jobsCap = 0;
+struct Arena commandArena;
+int interactive = 0;            // Prompt, job control and status chatter
+int lastStatus = 0;             // Exit status of the last command, returned at EOF
+pid_t shellPgid;
+struct termios shellTermios;
+
+struct JobUsage lastJobUsage;   // Filled in when a foreground job finishes
+struct CommandStats *commandStats[STATS_BUCKETS];
+
+struct LaunchStats launchStats;
+int forceForkLaunch = 0; // Set with "launch -m fork" to bypass posix_spawn
+
+void initLineReader(struct LineReader *reader, int fd) {
+    reader->fd = fd;
+    reader->cap = INPUT_BUFFER_SIZE;
+    reader->buf = malloc(reader->cap);
+    reader->start = reader->end = 0;
+    reader->eof = 0;
+}
+
+void initStringReader(struct LineReader *reader, const char *text) {
+    reader->fd = -1;
+    reader->end = strlen(text);
+    reader->cap = reader->end + 1;
+    reader->buf = malloc(reader->cap);
+    memcpy(reader->buf, text, reader->end);
+    reader->start = 0;
+    reader->eof = 1;
+}
+
+// Returns the next line without its newline, NUL-terminated in place, or
+// NULL at end of input. The line stays valid until the next call.
+char *readLine(struct LineReader *reader, size_t *length) {
+    while (1) {
+        char *line = reader->buf + reader->start;
+        char *newline = memchr(line, '\n', reader->end - reader->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            *length = newline - line;
+            reader->start += *length + 1;
+            return line;
+        }
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // Last line without a trailing newline
+            if (reader->end == reader->cap) {
+                reader->cap++;
+                reader->buf = realloc(reader->buf, reader->cap);
+                line = reader->buf + reader->start;
+            }
+            *length = reader->end - reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->end;
+            return line;
+        }
+
+        // Move the partial line to the front, growing only for huge lines
+        memmove(reader->buf, line, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->end == reader->cap) {
+            reader->cap *= 2;
+            reader->buf = realloc(reader->buf, reader->cap);
+        }
+
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->cap - reader->end);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            perror("error reading the command");
+            exit(-1);
+        }
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
+    }
+}
+
+void *arenaAlloc(struct Arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    struct ArenaChunk *chunk = arena->current;
+    while (chunk != NULL && chunk->used + size > chunk->size) {
+        // Chunks after current are left over from an earlier, bigger command
+        chunk = chunk->next;
+        if (chunk != NULL) {
+            chunk->used = 0;
+        }
+    }
+
+    if (chunk == NULL) {
+        size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(struct ArenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        // Keep the list intact so the chunk is reused after the next reset
+        if (arena->current == NULL) {
+            chunk->next = NULL;
+            arena->first = chunk;
+        } else {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+    }
+
+    arena->current = chunk;
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+char *arenaStrdup(struct Arena *arena, const char *str) {
+    size_t len = strlen(str);
+    char *copy = arenaAlloc(arena, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+void arenaReset(struct Arena *arena) {
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+// Split one input line into args in place. Quotes group words into one
+// argument and are removed; '|' and a trailing '&' separate tokens even
+// without spaces. The returned vector lives in the command arena.
+char **setup(char inputBuffer[], size_t length, int *background) {
+    // Each token takes at least one byte, so this is always enough
+    char **args = arenaAlloc(&commandArena, (length + 2) * sizeof(char *));
+    size_t ct = 0;
+    size_t w = 0;               // Write position: quotes are squeezed out
+    char *token = NULL;
+    char quote = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = inputBuffer[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else {
+                inputBuffer[w++] = c;
+            }
+            continue;
+        }
+        switch (c) {
+            case '"':
+            case '\'':
+                if (token == NULL)
+                    token = &inputBuffer[w];
+                quote = c;
+                break;
+            case '&':
+                // "2>&1" style redirections keep their ampersand
+                if (token != NULL && inputBuffer[w - 1] == '>') {
+                    inputBuffer[w++] = c;
+                    break;
+                }
+                *background = 1;
+                // fall through
+            case ' ':
+            case '\t':
+            case '\n':
+            case '|':
+                if (token != NULL) {
+                    inputBuffer[w++] = '\0';
+                    args[ct++] = token;
+                    token = NULL;
+                }
+                if (c == '|') {
+                    args[ct++] = "|";
+                }
+                break;
+            default:
+                if (token == NULL)
+                    token = &inputBuffer[w];
+                inputBuffer[w++] = c;
+        }
+    }
+    if (token != NULL) {
+        inputBuffer[w] = '\0';
+        args[ct++] = token;
+    }
+    args[ct] = NULL;
+    return args;
+}
+
+unsigned long hashCommandName(const char *name) {
+    // FNV-1a
+    unsigned long hash = 2166136261UL;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+void flushCommandCacheEntries() {
+    for (int i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+        struct CommandCacheEntry *entry = commandCache.buckets[i];
+        while (entry != NULL) {
+            struct CommandCacheEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        commandCache.buckets[i] = NULL;
+    }
+    commandCache.numEntries = 0;
+}
+
+void resetCommandCache() {
+    flushCommandCacheEntries();
+    for (int i = 0; i < commandCache.numDirs; i++) {
+        free(commandCache.dirs[i].dir);
+    }
+    free(commandCache.dirs);
+    free(commandCache.pathValue);
+    commandCache.dirs = NULL;
+    commandCache.numDirs = 0;
+    commandCache.pathValue = NULL;
+    commandCache.lastCheck = 0;
+}
+
+// Returns 1 if the directory's mtime differs from the one recorded
+int refreshPathDir(struct PathDir *pathDir) {
+    struct stat st;
+    int exists = stat(pathDir->dir, &st) == 0;
+    int changed = exists != pathDir->exists;
+    if (exists) {
+        changed |= st.st_mtim.tv_sec != pathDir->mtime.tv_sec || st.st_mtim.tv_nsec != pathDir->mtime.tv_nsec;
+        pathDir->mtime = st.st_mtim;
+    }
+    pathDir->exists = exists;
+    return changed;
+}
+
+// Make sure the cache still describes the current $PATH. A changed $PATH
+// rebuilds the directory list; a changed directory mtime (a command was
+// installed or removed) drops every cached resolution, hits and misses alike.
+void syncCommandCache() {
+    const char *path = getenv("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+
+    if (commandCache.pathValue == NULL || strcmp(commandCache.pathValue, path) != 0) {
+        resetCommandCache();
+        commandCache.pathValue = strdup(path);
+
+        int count = 1;
+        for (const char *p = path; *p; p++) {
+            if (*p == ':') {
+                count++;
+            }
+        }
+        commandCache.dirs = calloc(count, sizeof(struct PathDir));
+
+        const char *start = path;
+        while (1) {
+            const char *end = strchr(start, ':');
+            size_t len = end ? (size_t) (end - start) : strlen(start);
+            struct PathDir *pathDir = &commandCache.dirs[commandCache.numDirs++];
+            // An empty PATH entry means the current directory
+            pathDir->dir = len > 0 ? strndup(start, len) : strdup(".");
+            refreshPathDir(pathDir);
+            if (end == NULL) {
+                break;
+            }
+            start = end + 1;
+        }
+        commandCache.lastCheck = time(NULL);
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (now - commandCache.lastCheck < PATH_RECHECK_INTERVAL) {
+        return;
+    }
+    commandCache.lastCheck = now;
+
+    int changed = 0;
+    for (int i = 0; i < commandCache.numDirs; i++) {
+        changed |= refreshPathDir(&commandCache.dirs[i]);
+    }
+    if (changed) {
+        flushCommandCacheEntries();
+    }
+}
+
+char *resolveCommandPath(const char *name) {
+    size_t nameLen = strlen(name);
+    for (int i = 0; i < commandCache.numDirs; i++) {
+        struct PathDir *pathDir = &commandCache.dirs[i];
+        if (!pathDir->exists) {
+            continue;
+        }
+        size_t dirLen = strlen(pathDir->dir);
+        char *commandPath = malloc(dirLen + nameLen + 2);
+        memcpy(commandPath, pathDir->dir, dirLen);
+        commandPath[dirLen] = '/';
+        memcpy(commandPath + dirLen + 1, name, nameLen + 1);
+
+        // Check if the file exists at the specified path
+        struct stat st;
+        if (stat(commandPath, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            return commandPath;
+        }
+        free(commandPath);
+    }
+    return NULL;
+}
+
+// Returns the absolute path for a command name, or NULL if it is not on $PATH.
+// Names containing a slash are used as-is, like every other shell does.
+const char *lookupCommandPath(const char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    syncCommandCache();
+
+    unsigned long bucket = hashCommandName(name) % COMMAND_CACHE_BUCKETS;
+    struct CommandCacheEntry *entry;
+    for (entry = commandCache.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    entry = malloc(sizeof(struct CommandCacheEntry));
+    entry->name = strdup(name);
+    entry->path = resolveCommandPath(name);
+    entry->hits = 1;
+    entry->next = commandCache.buckets[bucket];
+    commandCache.buckets[bucket] = entry;
+    commandCache.numEntries++;
+    return entry->path;
+}
+
+// After cd: relative $PATH entries now name other directories. Only a
+// command found in an absolute directory ahead of the first relative one
+// keeps its resolution; a miss may now hit, and any other hit may now be
+// shadowed.
+void forgetRelativeCommandPaths() {
+    int firstRelative = 0;
+    while (firstRelative < commandCache.numDirs && *commandCache.dirs[firstRelative].dir == '/') {
+        firstRelative++;
+    }
+    if (firstRelative == commandCache.numDirs) {
+        return;
+    }
+    for (int i = firstRelative; i < commandCache.numDirs; i++) {
+        if (*commandCache.dirs[i].dir != '/') {
+            refreshPathDir(&commandCache.dirs[i]);
+        }
+    }
+
+    for (int i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+        struct CommandCacheEntry **link = &commandCache.buckets[i];
+        while (*link != NULL) {
+            struct CommandCacheEntry *entry = *link;
+            int keep = 0;
+            for (int d = 0; d < firstRelative && entry->path != NULL && !keep; d++) {
+                size_t len = strlen(commandCache.dirs[d].dir);
+                keep = strncmp(entry->path, commandCache.dirs[d].dir, len) == 0 && entry->path[len] == '/' &&
+                       strchr(entry->path + len + 1, '/') == NULL;
+            }
+            if (keep) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            commandCache.numEntries--;
+        }
+    }
+}
+
+// Resolve every command in $PATH ahead of time, for --serve: its forks
+// start with the cache this leaves. Only directories before the first
+// relative one are walked, since each connection runs in its own cwd.
+// Cheap once warm; a cache flushed by a changed directory fills again.
+void warmCommandCache() {
+    syncCommandCache();
+    if (commandCache.numEntries > 0) {
+        return;
+    }
+    for (int i = 0; i < commandCache.numDirs && *commandCache.dirs[i].dir == '/'; i++) {
+        DIR *dir = opendir(commandCache.dirs[i].dir);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_type != DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                lookupCommandPath(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    // Warming is not use
+    for (int i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+        for (struct CommandCacheEntry *entry = commandCache.buckets[i]; entry != NULL; entry = entry->next) {
+            entry->hits = 0;
+        }
+    }
+}
+
+// Drop a cached resolution that turned out to be stale
+void forgetCommandPath(const char *name) {
+    unsigned long bucket = hashCommandName(name) % COMMAND_CACHE_BUCKETS;
+    struct CommandCacheEntry **link = &commandCache.buckets[bucket];
+    while (*link != NULL) {
+        struct CommandCacheEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            commandCache.numEntries--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Open file onto fd in a child; a redirection that fails fails the command
+void redirectChildFd(const char *file, int flags, int fd) {
+    int opened = open(file, flags | O_CLOEXEC, 0644);
+    if (opened == -1) {
+        perror(file);
+        exit(EXIT_FAILURE);
+    }
+    dup2(opened, fd);
+    close(opened);
+}
+
+// Apply the redirection plan with dup2; only ever called in a forked
+// child. Background commands without "> file" write to /dev/null.
+void applyIOredirection(struct IORedirection *redirection, int background) {
+    struct IORedirection none = {NULL, NULL, 0, NULL, STDERR_UNCHANGED};
+    if (redirection == NULL) {
+        redirection = &none;
+    }
+
+    if (redirection->inputFile != NULL) {
+        redirectChildFd(redirection->inputFile, O_RDONLY, STDIN_FILENO);
+    }
+    if (redirection->errorToOutput == STDERR_TO_ORIGINAL_STDOUT) {
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+    }
+    if (redirection->outputFile != NULL) {
+        redirectChildFd(redirection->outputFile, redirection->outputFlags, STDOUT_FILENO);
+    } else if (background) {
+        redirectChildFd("/dev/null", O_WRONLY, STDOUT_FILENO);
+    }
+    if (redirection->errorFile != NULL) {
+        redirectChildFd(redirection->errorFile, O_WRONLY | O_CREAT | O_TRUNC, STDERR_FILENO);
+    }
+    if (redirection->errorToOutput == STDERR_TO_STDOUT) {
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+    }
+}
+
+// The same plan expressed as posix_spawn file actions
+void addIOredirectionActions(struct IORedirection *redirection, int background, posix_spawn_file_actions_t *actions) {
+    struct IORedirection none = {NULL, NULL, 0, NULL, STDERR_UNCHANGED};
+    if (redirection == NULL) {
+        redirection = &none;
+    }
+    if (redirection->inputFile != NULL) {
+        posix_spawn_file_actions_addopen(actions, STDIN_FILENO, redirection->inputFile, O_RDONLY, 0);
+    }
+    if (redirection->errorToOutput == STDERR_TO_ORIGINAL_STDOUT) {
+        posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    if (redirection->outputFile != NULL) {
+        posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, redirection->outputFile, redirection->outputFlags, 0644);
+    } else if (background) {
+        posix_spawn_file_actions_addopen(actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+    if (redirection->errorFile != NULL) {
+        posix_spawn_file_actions_addopen(actions, STDERR_FILENO, redirection->errorFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (redirection->errorToOutput == STDERR_TO_STDOUT) {
+        posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+}
+
+pid_t forkCommand(struct LaunchRequest *request) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child process
+        setpgid(0, request->pgid);
+        if (request->foreground) {
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+
+        // Undo the shell's own signal handling
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        if (request->stdinFd != -1) {
+            dup2(request->stdinFd, STDIN_FILENO);
+        }
+        if (request->stdoutFd != -1) {
+            dup2(request->stdoutFd, STDOUT_FILENO);
+        }
+        if (request->stderrFd != -1) {
+            dup2(request->stderrFd, STDERR_FILENO);
+        }
+        applyIOredirection(request->redirection, request->background);
+        // Whatever the shell or a library leaked without O_CLOEXEC
+        close_range(3, ~0U, 0);
+
+        execv(request->commandPath, request->args);
+
+        // execv only returns if the cached path has gone stale or is not executable
+        fprintf(stderr, "%s: %s\n", request->args[0], strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+// posix_spawn runs the child on a vfork-style clone, so launching does not
+// pay for copying the shell's page tables. Returns 0 or an errno value.
+int spawnCommand(struct LaunchRequest *request, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+
+    posix_spawn_file_actions_init(&actions);
+    if (request->stdinFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, request->stdinFd, STDIN_FILENO);
+    }
+    if (request->stdoutFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, request->stdoutFd, STDOUT_FILENO);
+    }
+    if (request->stderrFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, request->stderrFd, STDERR_FILENO);
+    }
+    addIOredirectionActions(request->redirection, request->background, &actions);
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34)
+    // close_range in the child, as forkCommand does
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#endif
+
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setpgroup(&attr, request->pgid);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    // The child takes the terminal itself, before it can possibly read from it
+    if (request->foreground) {
+        posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+    }
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    int err = posix_spawn(pid, request->commandPath, &actions, &attr, request->args, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+// Errors that say posix_spawn itself could not run, rather than that the
+// command or one of its redirections is bad; fork can still do the job.
+int isSpawnFailure(int err) {
+    return err == ENOSYS || err == EINVAL || err == ENOMEM || err == EAGAIN;
+}
+
+// Start an external command and return its pid, or -1 if it could not start
+pid_t launchCommand(struct LaunchRequest *request) {
+    pid_t pid;
+    if (!forceForkLaunch) {
+        int err = spawnCommand(request, &pid);
+        if (err == 0) {
+            launchStats.spawnLaunches++;
+            launchStats.lastPath = LAUNCH_SPAWN;
+            return pid;
+        }
+        if (!isSpawnFailure(err)) {
+            // ENOENT may also be a missing redirection target; only a
+            // path that can no longer be executed is stale
+            if ((err == ENOENT || err == ENOTDIR) && access(request->commandPath, X_OK) != 0) {
+                forgetCommandPath(request->args[0]);
+            }
+            fprintf(stderr, "%s: %s\n", request->args[0], strerror(err));
+            return -1;
+        }
+        launchStats.spawnFallbacks++;
+    }
+
+    pid = forkCommand(request);
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    launchStats.forkLaunches++;
+    launchStats.lastPath = LAUNCH_FORK;
+    return pid;
+}
+
+// Runs in signal context: reap every child that changed state and queue
+// its status. If the ring is full the rest stay unreaped until the shell
+// drains the ring and reaps them itself.
+void handleSIGCHLD(int sig) {
+    (void) sig;
+    int savedErrno = errno;
+    while ((childEventHead + 1) % CHILD_EVENT_RING != childEventTail) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if (pid <= 0) {
+            break;
+        }
+        childEvents[childEventHead].pid = pid;
+        childEvents[childEventHead].status = status;
+        childEvents[childEventHead].usage = usage;
+        clock_gettime(CLOCK_MONOTONIC, &childEvents[childEventHead].when);
+        atomic_signal_fence(memory_order_release);
+        childEventHead = (childEventHead + 1) % CHILD_EVENT_RING;
+    }
+    if ((childEventHead + 1) % CHILD_EVENT_RING == childEventTail) {
+        childEventsDropped = 1;
+    }
+    errno = savedErrno;
+}
+
+void initJobControl() {
+    struct sigaction sa;
+    sa.sa_handler = handleSIGCHLD;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (!interactive) {
+        return;
+    }
+
+    // Wait until we are in the foreground, then take our own process group
+    while (tcgetpgrp(STDIN_FILENO) != (shellPgid = getpgrp())) {
+        kill(-shellPgid, SIGTTIN);
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0);
+    shellPgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shellPgid);
+    tcgetattr(STDIN_FILENO, &shellTermios);
+}
+
+char *joinArgs(char *args[]) {
+    size_t len = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *text = malloc(len);
+    text[0] = '\0';
+    for (int i = 0; args[i] != NULL; i++) {
+        if (i > 0) {
+            strcat(text, " ");
+        }
+        strcat(text, args[i]);
+    }
+    return text;
+}
+
+// Takes ownership of command
+struct Job *createJob(char *command, int background) {
+    struct Job *job = calloc(1, sizeof(struct Job));
+    job->command = command;
+    job->background = background;
+    job->state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    // One past the highest id in use, as bash does: ids restart once the table empties
+    job->id = 1;
+    for (int i = 0; i < numJobs; i++) {
+        if (jobs[i]->id >= job->id) {
+            job->id = jobs[i]->id + 1;
+        }
+    }
+
+    if (numJobs == jobsCap) {
+        jobsCap = jobsCap ? jobsCap * 2 : 16;
+        jobs = realloc(jobs, jobsCap * sizeof(struct Job *));
+    }
+    jobs[numJobs++] = job;
+    return job;
+}
+
+void addJobProcess(struct Job *job, pid_t pid, const char *name) {
+    job->processes = realloc(job->processes, (job->numProcesses + 1) * sizeof(struct JobProcess));
+    struct JobProcess *process = &job->processes[job->numProcesses++];
+    process->pid = pid;
+    process->name = strdup(name);
+    process->state = JOB_RUNNING;
+    process->status = 0;
+    if (job->pgid == 0) {
+        job->pgid = pid;
+    }
+}
+
+void removeJob(struct Job *job) {
+    for (int i = 0; i < numJobs; i++) {
+        if (jobs[i] == job) {
+            memmove(&jobs[i], &jobs[i + 1], (numJobs - i - 1) * sizeof(struct Job *));
+            numJobs--;
+            break;
+        }
+    }
+    for (int i = 0; i < job->numProcesses; i++) {
+        free(job->processes[i].name);
+    }
+    free(job->processes);
+    free(job->command);
+    free(job);
+}
+
+void updateJobState(struct Job *job) {
+    int running = 0, stopped = 0;
+    for (int i = 0; i < job->numProcesses; i++) {
+        running += job->processes[i].state == JOB_RUNNING;
+        stopped += job->processes[i].state == JOB_STOPPED;
+    }
+    job->state = running ? JOB_RUNNING : stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+double secondsBetween(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+void applyChildEvent(struct ChildEvent *event) {
+    pid_t pid = event->pid;
+    int status = event->status;
+    for (int i = 0; i < numJobs; i++) {
+        struct Job *job = jobs[i];
+        for (int j = 0; j < job->numProcesses; j++) {
+            struct JobProcess *process = &job->processes[j];
+            if (process->pid != pid) {
+                continue;
+            }
+            if (WIFSTOPPED(status)) {
+                process->state = JOB_STOPPED;
+            } else if (WIFCONTINUED(status)) {
+                process->state = JOB_RUNNING;
+            } else {
+                process->state = JOB_DONE;
+                process->status = status;
+                process->usage = event->usage;
+                process->finished = event->when;
+                recordCommandUsage(process->name, secondsBetween(&job->started, &event->when), &event->usage);
+            }
+            updateJobState(job);
+            return;
+        }
+    }
+}
+
+// Apply queued wait statuses to the job table
+void drainChildEvents() {
+    while (childEventTail != childEventHead) {
+        atomic_signal_fence(memory_order_acquire);
+        struct ChildEvent event = childEvents[childEventTail];
+        childEventTail = (childEventTail + 1) % CHILD_EVENT_RING;
+        applyChildEvent(&event);
+    }
+
+    if (childEventsDropped) {
+        // The ring filled up; reap whatever the handler had to leave behind
+        sigset_t block, saved;
+        sigemptyset(&block);
+        sigaddset(&block, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &block, &saved);
+        childEventsDropped = 0;
+        struct ChildEvent event;
+        while ((event.pid = wait4(-1, &event.status, WNOHANG | WUNTRACED | WCONTINUED, &event.usage)) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &event.when);
+            applyChildEvent(&event);
+        }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+    }
+}
+
+// Sleep until the job is no longer running. SIGCHLD is blocked between
+// checking the table and sigsuspend(), so no wakeup can be lost.
+void waitForJob(struct Job *job) {
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    drainChildEvents();
+    while (job->state == JOB_RUNNING) {
+        sigset_t waitMask = saved;
+        sigdelset(&waitMask, SIGCHLD);
+        sigsuspend(&waitMask);
+        drainChildEvents();
+    }
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+void printProcessStatus(const char *prefix, int status) {
+    if (WIFEXITED(status)) {
+        printf("%s exited with status %d\n", prefix, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        printf("%s terminated by signal %d\n", prefix, WTERMSIG(status));
+    }
+}
+
+// Shell-style exit code: the status itself, or 128 + signal number
+int exitCode(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void reportJobStatus(struct Job *job) {
+    lastStatus = exitCode(job->processes[job->numProcesses - 1].status);
+    if (!interactive) {
+        return;
+    }
+    if (job->numProcesses == 1) {
+        printProcessStatus(job->background ? "Background process" : "Foreground process", job->processes[0].status);
+        return;
+    }
+    for (int i = 0; i < job->numProcesses; i++) {
+        char prefix[MAX_PATH];
+        snprintf(prefix, sizeof(prefix), "Stage %d (%s)", i, job->processes[i].name);
+        printProcessStatus(prefix, job->processes[i].status);
+    }
+}
+
+void addTimeval(struct timeval *sum, struct timeval *add) {
+    sum->tv_sec += add->tv_sec;
+    sum->tv_usec += add->tv_usec;
+    if (sum->tv_usec >= 1000000) {
+        sum->tv_sec++;
+        sum->tv_usec -= 1000000;
+    }
+}
+
+void summarizeJobUsage(struct Job *job, struct JobUsage *summary) {
+    memset(summary, 0, sizeof(*summary));
+    for (int i = 0; i < job->numProcesses; i++) {
+        struct JobProcess *process = &job->processes[i];
+        double wall = secondsBetween(&job->started, &process->finished);
+        if (wall > summary->wallSeconds) {
+            summary->wallSeconds = wall;
+        }
+        addTimeval(&summary->usage.ru_utime, &process->usage.ru_utime);
+        addTimeval(&summary->usage.ru_stime, &process->usage.ru_stime);
+        if (process->usage.ru_maxrss > summary->usage.ru_maxrss) {
+            summary->usage.ru_maxrss = process->usage.ru_maxrss;
+        }
+        summary->usage.ru_nvcsw += process->usage.ru_nvcsw;
+        summary->usage.ru_nivcsw += process->usage.ru_nivcsw;
+    }
+}
+
+// Give the job the terminal, wait for it to finish or stop, then take the
+// terminal back. A stopped job stays in the table for fg/bg.
+void runForegroundJob(struct Job *job, int resume) {
+    job->background = 0;
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    if (resume) {
+        for (int i = 0; i < job->numProcesses; i++) {
+            if (job->processes[i].state == JOB_STOPPED) {
+                job->processes[i].state = JOB_RUNNING;
+            }
+        }
+        job->state = JOB_RUNNING;
+        kill(-job->pgid, SIGCONT);
+    }
+
+    waitForJob(job);
+
+    if (interactive) {
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shellTermios);
+    }
+
+    if (job->state == JOB_STOPPED) {
+        job->background = 1;
+        printf("\n[%d] Stopped  %s\n", job->id, job->command);
+    } else {
+        summarizeJobUsage(job, &lastJobUsage);
+        reportJobStatus(job);
+        removeJob(job);
+    }
+}
+
+const char *jobStateName(enum JobState state) {
+    return state == JOB_RUNNING ? "Running" : state == JOB_STOPPED ? "Stopped" : "Done";
+}
+
+// Report background jobs that finished since the last prompt. A script
+// gets no such report, so its finished jobs stay in the table until wait
+// or jobs hands over their status.
+void notifyFinishedJobs() {
+    drainChildEvents();
+    if (!interactive) {
+        return;
+    }
+    for (int i = 0; i < numJobs;) {
+        struct Job *job = jobs[i];
+        if (job->state == JOB_DONE && job->background) {
+            int status = job->processes[job->numProcesses - 1].status;
+            printf("[%d] Done (%d)  %s\n", job->id, exitCode(status), job->command);
+            removeJob(job);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Look up "%N", "N", or the most recent job when spec is NULL
+struct Job *findJob(const char *spec) {
+    if (spec == NULL) {
+        return numJobs > 0 ? jobs[numJobs - 1] : NULL;
+    }
+    if (spec[0] == '%') {
+        spec++;
+    }
+    int id = atoi(spec);
+    for (int i = 0; i < numJobs; i++) {
+        if (jobs[i]->id == id) {
+            return jobs[i];
+        }
+    }
+    return NULL;
+}
+
+void handleJobsCommand(char *args[]) {
+    (void) args;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    drainChildEvents();
+    for (int i = 0; i < numJobs;) {
+        struct Job *job = jobs[i];
+        double elapsed = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+        printf("[%d] %-8s %6d %8.1fs  %s", job->id, jobStateName(job->state), job->pgid, elapsed, job->command);
+        if (job->state == JOB_DONE) {
+            int status = job->processes[job->numProcesses - 1].status;
+            printf("  (status %d)", exitCode(status));
+        }
+        printf("\n");
+        if (job->state == JOB_DONE && job->background) {
+            removeJob(job);  // Listed with its status, it is not reported again
+        } else {
+            i++;
+        }
+    }
+}
+
+// A finished job's status becomes the shell's, as after a foreground job;
+// one that stopped instead stays in the table for fg/bg
+void finishWaitedJob(struct Job *job) {
+    if (job->state == JOB_DONE) {
+        summarizeJobUsage(job, &lastJobUsage);
+        reportJobStatus(job);
+        removeJob(job);
+    }
+}
+
+void handleWaitCommand(char *args[]) {
+    if (args[1] != NULL) {
+        struct Job *job = findJob(args[1]);
+        if (job == NULL) {
+            printf("wait: no such job: %s\n", args[1]);
+            lastStatus = 127;
+            return;
+        }
+        waitForJob(job);
+        finishWaitedJob(job);
+        return;
+    }
+    // Wait for every background job; the status is the last one's
+    lastStatus = 0;
+    for (int i = 0; i < numJobs;) {
+        struct Job *job = jobs[i];
+        if (job->state == JOB_STOPPED) {
+            i++;
+            continue;
+        }
+        waitForJob(job);
+        if (job->state != JOB_DONE) {
+            i++;
+        }
+        finishWaitedJob(job);
+    }
+}
+
+void handleFgCommand(char *args[]) {
+    struct Job *job = findJob(args[1]);
+    if (job == NULL) {
+        printf("fg: no such job\n");
+        return;
+    }
+    if (job->state == JOB_DONE) {
+        reportJobStatus(job);
+        removeJob(job);
+        return;
+    }
+    printf("%s\n", job->command);
+    runForegroundJob(job, 1);
+}
+
+void handleBgCommand(char *args[]) {
+    struct Job *job = findJob(args[1]);
+    if (job == NULL) {
+        printf("bg: no such job\n");
+        return;
+    }
+    if (job->state == JOB_STOPPED) {
+        for (int i = 0; i < job->numProcesses; i++) {
+            if (job->processes[i].state == JOB_STOPPED) {
+                job->processes[i].state = JOB_RUNNING;
+            }
+        }
+        job->state = JOB_RUNNING;
+        job->background = 1;
+        kill(-job->pgid, SIGCONT);
+    }
+    printf("[%d] %s &\n", job->id, job->command);
+}
+
+int hasActiveJobs() {
+    drainChildEvents();
+    for (int i = 0; i < numJobs; i++) {
+        if (jobs[i]->state != JOB_DONE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+double timevalSeconds(struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// Every process the shell reaps, foreground or background, ends up here
+void recordCommandUsage(const char *name, double wallSeconds, struct rusage *usage) {
+    const char *slash = strrchr(name, '/');
+    if (slash != NULL) {
+        name = slash + 1;
+    }
+
+    unsigned long bucket = hashCommandName(name) % STATS_BUCKETS;
+    struct CommandStats *stats;
+    for (stats = commandStats[bucket]; stats != NULL; stats = stats->next) {
+        if (strcmp(stats->name, name) == 0) {
+            break;
+        }
+    }
+    if (stats == NULL) {
+        stats = calloc(1, sizeof(struct CommandStats));
+        stats->name = strdup(name);
+        stats->next = commandStats[bucket];
+        commandStats[bucket] = stats;
+    }
+
+    stats->recentWall[stats->count % STATS_WINDOW] = wallSeconds;
+    stats->count++;
+    stats->totalWall += wallSeconds;
+    stats->totalUser += timevalSeconds(&usage->ru_utime);
+    stats->totalSys += timevalSeconds(&usage->ru_stime);
+    if (usage->ru_maxrss > stats->peakRss) {
+        stats->peakRss = usage->ru_maxrss;
+    }
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+int compareStatsByCount(const void *a, const void *b) {
+    const struct CommandStats *x = *(struct CommandStats * const *) a;
+    const struct CommandStats *y = *(struct CommandStats * const *) b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+void handleStatsCommand(char *args[]) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            while (commandStats[i] != NULL) {
+                struct CommandStats *next = commandStats[i]->next;
+                free(commandStats[i]->name);
+                free(commandStats[i]);
+                commandStats[i] = next;
+            }
+        }
+        return;
+    }
+
+    drainChildEvents();
+    int count = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        for (struct CommandStats *stats = commandStats[i]; stats != NULL; stats = stats->next) {
+            count++;
+        }
+    }
+    struct CommandStats **sorted = arenaAlloc(&commandArena, (count + 1) * sizeof(struct CommandStats *));
+    count = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        for (struct CommandStats *stats = commandStats[i]; stats != NULL; stats = stats->next) {
+            sorted[count++] = stats;
+        }
+    }
+    qsort(sorted, count, sizeof(struct CommandStats *), compareStatsByCount);
+
+    printf("%-20s %8s %10s %10s %10s %10s %10s\n", "command", "count", "mean", "p95", "user", "sys", "maxrss");
+    for (int i = 0; i < count; i++) {
+        struct CommandStats *stats = sorted[i];
+        // p95 over the most recent STATS_WINDOW runs
+        int window = stats->count < STATS_WINDOW ? (int) stats->count : STATS_WINDOW;
+        double recent[STATS_WINDOW];
+        memcpy(recent, stats->recentWall, window * sizeof(double));
+        qsort(recent, window, sizeof(double), compareDoubles);
+        double p95 = recent[(window * 95 - 1) / 100];
+
+        printf("%-20s %8lu %9.3fs %9.3fs %9.3fs %9.3fs %8ldKB\n", stats->name, stats->count,
+               stats->totalWall / stats->count, p95, stats->totalUser, stats->totalSys, stats->peakRss);
+    }
+}
+
+// "time <command>": run the command, then report what it cost. External
+// commands are measured from their wait4() rusage; builtins run inside the
+// shell, so they are measured with getrusage() on the shell itself.
+void handleTimeCommand(char *args[]) {
+    if (args[1] == NULL) {
+        printf("Usage: time <command>\n");
+        return;
+    }
+
+    struct timespec start, end;
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    memset(&lastJobUsage, 0, sizeof(lastJobUsage));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    runCommand(args + 1, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &after);
+
+    struct rusage *usage = &lastJobUsage.usage;
+    double user = timevalSeconds(&usage->ru_utime);
+    double sys = timevalSeconds(&usage->ru_stime);
+    long maxrss = usage->ru_maxrss;
+    long voluntary = usage->ru_nvcsw, involuntary = usage->ru_nivcsw;
+    if (lastJobUsage.wallSeconds == 0) {
+        user = timevalSeconds(&after.ru_utime) - timevalSeconds(&before.ru_utime);
+        sys = timevalSeconds(&after.ru_stime) - timevalSeconds(&before.ru_stime);
+        maxrss = after.ru_maxrss;
+        voluntary = after.ru_nvcsw - before.ru_nvcsw;
+        involuntary = after.ru_nivcsw - before.ru_nivcsw;
+    }
+
+    fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  ctxsw %ld/%ld\n",
+            secondsBetween(&start, &end), user, sys, maxrss, voluntary, involuntary);
+}
+
+void executeCommand(char *args[], int background, struct IORedirection *redirection) {
+    // Remove the ampersand from the command name if it exists
+    size_t len = strlen(args[0]);
+    if (len > 0 && args[0][len - 1] == '&') {
+        args[0][len - 1] = '\0';
+    }
+
+    // Resolve in the shell so the result is cached for the next launch
+    const char *commandPath = lookupCommandPath(args[0]);
+    if (commandPath == NULL) {
+        fprintf(stderr, "Command not found: %s\n", args[0]);
+        lastStatus = 127;
+        return;
+    }
+    launchExternalCommand(commandPath, args, background, redirection);
+}
+
+// Start an already resolved command as a new job and wait for it unless it
+// runs in the background
+void launchExternalCommand(const char *commandPath, char *args[], int background, struct IORedirection *redirection) {
+    struct Job *job = createJob(joinArgs(args), background);
+    struct LaunchRequest request = {commandPath, args, redirection, background, 0, -1, -1, -1,
+                                    interactive && !background};
+    pid_t pid = launchCommand(&request);
+    if (pid > 0) {
+        if (interactive) {
+            printf("Executing: %s (%s)\n", commandPath, launchStats.lastPath == LAUNCH_SPAWN ? "spawn" : "fork");
+        }
+        addJobProcess(job, pid, args[0]);
+        if (!background) {
+            // Wait for the foreground process to complete
+            runForegroundJob(job, 0);
+        } else {
+            // In background mode, do not wait for the process to complete
+            if (interactive) {
+                printf("[%d] Background process started: %d\n", job->id, pid);
+            }
+            lastStatus = 0;
+        }
+    } else {
+        removeJob(job);
+        lastStatus = 127;
+    }
+}
+
+int isPipeline(char *args[]) {
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "|") == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run "a | b | c": every stage is its own process, all in the process group
+// of the first stage. Each stage's own redirections override the pipe ends,
+// so "a | b > file" writes b's output straight to the file.
+void runPipeline(char *args[], int background) {
+    int numStages = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "|") == 0) {
+            // "| b", "a |" and "a | | b" each leave a stage with nothing to run
+            if (i == 0 || strcmp(args[i - 1], "|") == 0 || args[i + 1] == NULL) {
+                fprintf(stderr, "Syntax error: empty pipeline stage\n");
+                lastStatus = 2;
+                return;
+            }
+            numStages++;
+        }
+    }
+    char *command = joinArgs(args);
+
+    char ***stages = arenaAlloc(&commandArena, numStages * sizeof(char **));
+    struct IORedirection *redirections = arenaAlloc(&commandArena, numStages * sizeof(struct IORedirection));
+    const char **commandPaths = arenaAlloc(&commandArena, numStages * sizeof(char *));
+
+    int stage = 0;
+    stages[0] = args;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "|") == 0) {
+            args[i] = NULL;
+            stages[++stage] = &args[i + 1];
+        }
+    }
+
+    // Resolve every stage before starting any, so a typo launches nothing
+    int ok = 1;
+    for (stage = 0; stage < numStages && ok; stage++) {
+        handleIOredirection(stages[stage], &redirections[stage]);
+        if (stages[stage][0] == NULL) {
+            // Nothing but redirections
+            fprintf(stderr, "Syntax error: empty pipeline stage\n");
+            lastStatus = 2;
+            ok = 0;
+            break;
+        }
+        commandPaths[stage] = lookupCommandPath(stages[stage][0]);
+        if (commandPaths[stage] == NULL) {
+            fprintf(stderr, "Command not found: %s\n", stages[stage][0]);
+            lastStatus = 127;
+            ok = 0;
+        } else {
+            // Copy the path out of the cache: a later lookup's flush or a
+            // failed launch may evict it
+            commandPaths[stage] = arenaStrdup(&commandArena, commandPaths[stage]);
+        }
+    }
+    if (!ok) {
+        free(command);
+        return;
+    }
+
+    // Keep the first stage unreaped while later stages join its process
+    // group: a reaped leader takes the group with it and setpgid fails
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+
+    struct Job *job = createJob(command, background);
+    int prevRead = -1;
+    for (stage = 0; stage < numStages; stage++) {
+        int fds[2] = {-1, -1};
+        if (stage < numStages - 1) {
+            if (pipe2(fds, O_CLOEXEC) == -1) {
+                perror("pipe");
+                break;
+            }
+#ifdef F_SETPIPE_SZ
+            // Bigger pipes mean fewer context switches between stages on bulk data;
+            // the kernel caps this at /proc/sys/fs/pipe-max-size
+            fcntl(fds[1], F_SETPIPE_SZ, PIPELINE_PIPE_SIZE);
+#endif
+        }
+
+        struct LaunchRequest request = {commandPaths[stage], stages[stage], &redirections[stage],
+                                        background && stage == numStages - 1, job->pgid, prevRead, fds[1], -1,
+                                        interactive && !background && job->pgid == 0};
+        pid_t pid = launchCommand(&request);
+
+        if (prevRead != -1) {
+            close(prevRead);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        prevRead = fds[0];
+
+        if (pid < 0) {
+            break;
+        }
+        addJobProcess(job, pid, stages[stage][0]);
+    }
+    if (prevRead != -1) {
+        close(prevRead);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    if (job->numProcesses == 0) {
+        removeJob(job);
+    } else if (background) {
+        if (interactive) {
+            printf("[%d] Background pipeline started: %d\n", job->id, job->pgid);
+        }
+        lastStatus = 0;
+    } else {
+        runForegroundJob(job, 0);
+    }
+}
+
+
+void handleHashCommand(char *args[]) {
+    if (args[1] == NULL) {
+        if (commandCache.numEntries == 0) {
+            printf("hash: hash table empty\n");
+            return;
+        }
+        printf("hits\tcommand\n");
+        for (int i = 0; i < COMMAND_CACHE_BUCKETS; i++) {
+            for (struct CommandCacheEntry *entry = commandCache.buckets[i]; entry != NULL; entry = entry->next) {
+                printf("%4lu\t%s\n", entry->hits, entry->path ? entry->path : entry->name);
+            }
+        }
+    } else if (strcmp(args[1], "-r") == 0) {
+        resetCommandCache();
+    } else {
+        // Pre-resolve the given names
+        for (int i = 1; args[i] != NULL; i++) {
+            if (lookupCommandPath(args[i]) == NULL) {
+                printf("hash: %s: not found\n", args[i]);
+            }
+        }
+    }
+}
+
+void handleWhichCommand(char *args[]) {
+    if (args[1] == NULL) {
+        printf("Usage: which <command>...\n");
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        const char *commandPath = lookupCommandPath(args[i]);
+        if (commandPath != NULL) {
+            printf("%s\n", commandPath);
+        } else {
+            printf("%s not found\n", args[i]);
+        }
+    }
+}
+
+void handleLaunchCommand(char *args[]) {
+    if (args[1] != NULL && strcmp(args[1], "-m") == 0) {
+        if (args[2] != NULL && strcmp(args[2], "fork") == 0) {
+            forceForkLaunch = 1;
+        } else if (args[2] != NULL && strcmp(args[2], "spawn") == 0) {
+            forceForkLaunch = 0;
+        } else {
+            printf("Usage: launch -m <spawn|fork>\n");
+        }
+        return;
+    }
+    printf("mode: %s\n", forceForkLaunch ? "fork" : "spawn");
+    printf("spawn: %lu\n", launchStats.spawnLaunches);
+    printf("fork: %lu\n", launchStats.forkLaunches);
+    printf("spawn fallbacks: %lu\n", launchStats.spawnFallbacks);
+}
+
+void handleExitCommand(char *args[]) {
+    (void) args;
+    // Terminate the shell process
+    if (!hasActiveJobs()) {
         exit(0);
+    } else {
+        printf("Cannot exit while there are background processes running.\n");
+    }
+}
+
+void handleCdCommand(char *args[]) {
+    const char *dir = args[1];
+    if (dir == NULL) {
+        dir = getenv("HOME");
+    } else if (strcmp(dir, "-") == 0) {
+        dir = getenv("OLDPWD");
+    }
+    if (dir == NULL) {
+        fprintf(stderr, "cd: %s not set\n", args[1] == NULL ? "HOME" : "OLDPWD");
+        lastStatus = 1;
+        return;
+    }
+
+    char previous[PATH_MAX];
+    if (getcwd(previous, sizeof(previous)) == NULL) {
+        previous[0] = '\0';
+    }
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        lastStatus = 1;
+        return;
+    }
+    char current[PATH_MAX];
+    if (getcwd(current, sizeof(current)) != NULL) {
+        setenv("PWD", current, 1);
+        if (args[1] != NULL && strcmp(args[1], "-") == 0) {
+            printf("%s\n", current);
+        }
+    }
+    if (previous[0] != '\0') {
+        setenv("OLDPWD", previous, 1);
+    }
+    forgetRelativeCommandPaths();
+}
+
+void handlePwdCommand(char *args[]) {
+    (void) args;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        lastStatus = 1;
+        return;
+    }
+    printf("%s\n", cwd);
+}
+
+void handleEchoCommand(char *args[]) {
+    int i = 1;
+    int newline = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        if (i > first) {
+            putchar(' ');
+        }
+        fputs(args[i], stdout);
+    }
+    if (newline) {
+        putchar('\n');
+    }
+}
+
+// Copy all of fd to stdout inside the kernel: copy_file_range when both
+// ends are regular files (it can share extents on filesystems that reflink),
+// else sendfile, else plain read/write for pipes and terminals as input.
+int copyToStdout(int fd) {
+    struct stat st;
+    int outRegular = fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+    int inRegular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    ssize_t n;
+
+    if (inRegular && outRegular) {
+        while ((n = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, 1 << 30, 0)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF) {
+            return -1;
+        }
+    }
+    if (inRegular) {
+        while ((n = sendfile(STDOUT_FILENO, fd, NULL, 1 << 30)) > 0) {
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return -1;
+        }
+    }
+
+    char buffer[INPUT_BUFFER_SIZE];
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (writeOutput(STDOUT_FILENO, buffer, n) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void handleCatCommand(char *args[]) {
+    char *stdinOnly[] = {"cat", "-", NULL};
+    if (args[1] == NULL) {
+        args = stdinOnly;
+    }
+    fflush(stdout);
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = strcmp(args[i], "-") == 0 ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || copyToStdout(fd) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            lastStatus = 1;
+        }
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+    }
+}
+
+void handleTrueCommand(char *args[]) {
+    (void) args;
+    lastStatus = 0;
+}
+
+void handleFalseCommand(char *args[]) {
+    (void) args;
+    lastStatus = 1;
+}
+
+// The unary file and string tests; -1 if op is not one
+int evaluateUnaryTest(const char *op, const char *arg) {
+    struct stat st;
+    if (strcmp(op, "-n") == 0) {
+        return *arg != '\0';
+    } else if (strcmp(op, "-z") == 0) {
+        return *arg == '\0';
+    } else if (strcmp(op, "-r") == 0) {
+        return access(arg, R_OK) == 0;
+    } else if (strcmp(op, "-w") == 0) {
+        return access(arg, W_OK) == 0;
+    } else if (strcmp(op, "-x") == 0) {
+        return access(arg, X_OK) == 0;
+    } else if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    } else if (strlen(op) != 2 || op[0] != '-' || strchr("edfsbcpS", op[1]) == NULL) {
+        return -1;
+    }
+    if (stat(arg, &st) == -1) {
+        return 0;
+    }
+    switch (op[1]) {
+        case 'e': return 1;
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        default: return S_ISSOCK(st.st_mode);
+    }
+}
+
+// String, integer and file-age comparisons; -1 if op is not one
+int evaluateBinaryTest(const char *left, const char *op, const char *right) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0) {
+        struct stat a, b;
+        int haveA = stat(left, &a) == 0, haveB = stat(right, &b) == 0;
+        if (op[1] == 'o') {
+            struct stat swap = a;
+            a = b;
+            b = swap;
+            int tmp = haveA;
+            haveA = haveB;
+            haveB = tmp;
+        }
+        return haveA && (!haveB || a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                         (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec));
+    }
+
+    const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int which = -1;
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            which = i;
+        }
+    }
+    if (which == -1) {
+        return -1;
+    }
+    char *endLeft, *endRight;
+    long a = strtol(left, &endLeft, 10), b = strtol(right, &endRight, 10);
+    if (*left == '\0' || *endLeft != '\0' || *right == '\0' || *endRight != '\0') {
+        fprintf(stderr, "test: integer expression expected\n");
+        return -2;
+    }
+    int results[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    return results[which];
+}
+
+// POSIX test by argument count, with "!" negation. Status 0 for true, 1
+// for false and 2 for a malformed expression.
+void handleTestCommand(char *args[]) {
+    int argc = 0;
+    while (args[argc] != NULL) {
+        argc++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            lastStatus = 2;
+            return;
+        }
+        argc--;
+    }
+
+    char **operands = args + 1;
+    int count = argc - 1;
+    int negate = 0;
+    if (count >= 2 && strcmp(operands[0], "!") == 0 && count != 3) {
+        negate = 1;
+        operands++;
+        count--;
+    }
+
+    int result;
+    if (count == 0) {
+        result = 0;
+    } else if (count == 1) {
+        result = operands[0][0] != '\0';
+    } else if (count == 2) {
+        result = evaluateUnaryTest(operands[0], operands[1]);
+    } else if (count == 3) {
+        result = evaluateBinaryTest(operands[0], operands[1], operands[2]);
+        if (result == -1 && strcmp(operands[0], "!") == 0) {
+            result = evaluateUnaryTest(operands[1], operands[2]);
+            negate = 1;
+        }
+    } else {
+        result = -1;
+    }
+
+    if (result == -1) {
+        fprintf(stderr, "test: unsupported expression\n");
+    }
+    if (result < 0) {
+        lastStatus = 2;
+        return;
+    }
+    lastStatus = (result != 0) == negate;
+}
+
+// Sorted by name for bsearch
+const struct Builtin builtins[] = {
+        {"[", handleTestCommand},
+        {"bg", handleBgCommand},
+        {"bookmark", handleBookmarkCommand},
+        {"cat", handleCatCommand},
+        {"cd", handleCdCommand},
+        {"echo", handleEchoCommand},
+        {"exit", handleExitCommand},
+        {"false", handleFalseCommand},
+        {"fg", handleFgCommand},
+        {"hash", handleHashCommand},
+        {"history", handleHistoryCommand},
+        {"jobs", handleJobsCommand},
+        {"launch", handleLaunchCommand},
+        {"parallel", handleParallelCommand},
+        {"pwd", handlePwdCommand},
+        {"search", handleSearchCommand},
+        {"stats", handleStatsCommand},
+        {"test", handleTestCommand},
+        {"true", handleTrueCommand},
+        {"wait", handleWaitCommand},
+        {"which", handleWhichCommand},
+};
+
+int compareBuiltinName(const void *key, const void *entry) {
+    return strcmp(key, ((const struct Builtin *) entry)->name);
+}
+
+const struct Builtin *findBuiltin(const char *name) {
+    return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(struct Builtin),
+                   compareBuiltinName);
+}
+
+// Commands the shell runs itself, "time" included, so bookmarks and
+// lookups know not to resolve them on PATH
+int isBuiltinCommand(const char *name) {
+    return strcmp(name, "time") == 0 || findBuiltin(name) != NULL;
+}
+
+// Point the shell's own stdin/stdout/stderr at the plan's files for the
+// length of one builtin. The originals are parked above the standard fds
+// in saved[] for restoreBuiltinFds.
+int redirectBuiltinFds(struct IORedirection *redirection, int saved[3]) {
+    const char *files[3] = {redirection->inputFile, redirection->outputFile, redirection->errorFile};
+    int flags[3] = {O_RDONLY, redirection->outputFlags, O_WRONLY | O_CREAT | O_TRUNC};
+    saved[0] = saved[1] = saved[2] = -1;
+    fflush(stdout);
+    for (int fd = 0; fd < 3; fd++) {
+        int file;
+        if (fd == STDERR_FILENO && redirection->errorToOutput != STDERR_UNCHANGED) {
+            // The shell's stdout was parked in saved[1] if ">" replaced it
+            int original = redirection->errorToOutput == STDERR_TO_ORIGINAL_STDOUT && saved[1] != -1;
+            file = fcntl(original ? saved[1] : STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+        } else if (files[fd] != NULL) {
+            file = open(files[fd], flags[fd] | O_CLOEXEC, 0644);
+        } else {
+            continue;
+        }
+        if (file == -1) {
+            fprintf(stderr, "%s: %s\n", files[fd] != NULL ? files[fd] : "2>&1", strerror(errno));
+            return -1;
+        }
+        saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        dup2(file, fd);
+        close(file);
+    }
+    return 0;
+}
+
+void restoreBuiltinFds(int saved[3]) {
+    fflush(stdout);
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] != -1) {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+}
+
+// Run args in the shell process if it names a builtin. Returns 0 if it
+// does not.
+int handleInternalCommands(char *args[], struct IORedirection *redirection) {
+    const struct Builtin *builtin = findBuiltin(args[0]);
+    if (builtin == NULL) {
+        return 0; // Not an internal command
+    }
+
+    int saved[3];
+    if (redirectBuiltinFds(redirection, saved) == 0) {
+        builtin->handler(args);
+    } else {
+        lastStatus = 1;
+    }
+    restoreBuiltinFds(saved);
+    return 1; // Internal command handled
+}
+
+
+// Strip redirection operators out of args and record them in the plan.
+// Nothing is opened here: the shell's own descriptors are never touched.
+void handleIOredirection(char *args[], struct IORedirection *redirection) {
+    redirection->inputFile = NULL;
+    redirection->outputFile = NULL;
+    redirection->outputFlags = 0;
+    redirection->errorFile = NULL;
+    redirection->errorToOutput = STDERR_UNCHANGED;
+
+    for (int i = 0; args[i] != NULL; i++) {
+        if (strcmp(args[i], "2>&1") == 0) {
+            // Error to wherever output goes
+            args[i] = NULL;
+            redirection->errorFile = NULL;
+            redirection->errorToOutput = redirection->outputFile != NULL ? STDERR_TO_STDOUT : STDERR_TO_ORIGINAL_STDOUT;
+        } else if (strcmp(args[i], "<") == 0) {
+            // Input redirection
+            args[i] = NULL;
+            redirection->inputFile = args[i + 1];
+        } else if (strcmp(args[i], ">") == 0) {
+            // Output redirection
+            args[i] = NULL;
+            redirection->outputFile = args[i + 1];
+            redirection->outputFlags = O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (strcmp(args[i], ">>") == 0) {
+            // Append output redirection
+            args[i] = NULL;
+            redirection->outputFile = args[i + 1];
+            redirection->outputFlags = O_WRONLY | O_CREAT | O_APPEND;
+        } else if (strcmp(args[i], "2>") == 0) {
+            // Error redirection
+            args[i] = NULL;
+            redirection->errorFile = args[i + 1];
+            redirection->errorToOutput = STDERR_UNCHANGED;
+        }
+    }
+}
+
+
+// Job table bookkeeping for a captured run that has just been launched, or
+// failed to launch
+void trackCapturedRun(struct CapturedRun *run, pid_t pid, const char *name) {
+    if (pid > 0) {
+        addJobProcess(run->job, pid, name);
+        return;
+    }
+    if (run->job != NULL) {
+        removeJob(run->job);
+        run->job = NULL;
+    }
+    run->finished = 1;
+    run->status = 127;
+}
+
+// Launch a resolved external command with stdin from /dev/null and its
+// stdout and stderr captured
+void startCapturedCommand(struct CapturedRun *run, const char *commandPath, char **args,
+                          struct IORedirection *redirection, int nullFd) {
+    pid_t pid = -1;
+    run->outputFd = memfd_create("captured", MFD_CLOEXEC);
+    if (run->outputFd == -1) {
+        perror("memfd_create");
+    } else {
+        run->job = createJob(joinArgs(args), 0);
+        struct LaunchRequest request = {commandPath, args, redirection, 0, 0, nullFd, run->outputFd,
+                                        run->outputFd, 0};
+        pid = launchCommand(&request);
+    }
+    trackCapturedRun(run, pid, args[0]);
+}
+
+// Copy a finished run's output to stdout in one piece
+void printCapturedRun(struct CapturedRun *run, struct CapturedBatch *batch) {
+    if (batch->header != NULL) {
+        batch->header(run, batch->context);
+    }
+    fflush(stdout);
+    if (run->outputFd == -1) {
+        return;
+    }
+    char buffer[INPUT_BUFFER_SIZE];
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(run->outputFd, buffer, sizeof(buffer), offset)) > 0) {
+        writeOutput(STDOUT_FILENO, buffer, n);
+        offset += n;
+    }
+    close(run->outputFd);
+    run->outputFd = -1;
+}
+
+volatile sig_atomic_t capturedInterrupt = 0;
+
+// While captured jobs run: they are in their own process groups, away from
+// the terminal, so Ctrl-C reaches only the shell and is passed on by hand
+void handleCapturedInterrupt(int sig) {
+    capturedInterrupt = sig;
+}
+
+// Keep up to batch->limit jobs running until every item has had its turn.
+// Each output is printed whole: as soon as its job finishes, or with
+// keepOrder once it and every item before it have finished. Returns the
+// runs, of which batch->started were launched; the caller frees them.
+struct CapturedRun *runCapturedJobs(struct CapturedBatch *batch) {
+    struct CapturedRun *runs = calloc(batch->count ? batch->count : 1, sizeof(struct CapturedRun));
+    int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    // SIGCHLD, SIGINT and SIGTERM stay blocked except inside sigsuspend(),
+    // as in waitForJob()
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+    struct sigaction sa = {0}, savedInt, savedTerm;
+    sa.sa_handler = handleCapturedInterrupt;
+    sigemptyset(&sa.sa_mask);
+    capturedInterrupt = 0;
+    sigaction(SIGINT, &sa, &savedInt);
+    sigaction(SIGTERM, &sa, &savedTerm);
+
+    int next = 0, running = 0, printed = 0, halted = 0;
+    while (printed < (halted ? next : batch->count)) {
+        if (capturedInterrupt) {
+            // Pass it on to everything running and start nothing more
+            for (int i = 0; i < next; i++) {
+                if (runs[i].job != NULL) {
+                    kill(-runs[i].job->pgid, capturedInterrupt);
+                }
+            }
+            capturedInterrupt = 0;
+            halted = 1;
+        }
+
+        while (!halted && running < batch->limit && next < batch->count) {
+            struct CapturedRun *run = &runs[next];
+            run->index = next++;
+            run->outputFd = -1;
+            batch->start(run, nullFd, batch->context);
+            running += !run->finished;
+        }
+
+        drainChildEvents();
+        int finishedNow = 0;
+        for (int i = 0; i < next; i++) {
+            struct CapturedRun *run = &runs[i];
+            if (run->job != NULL && run->job->state == JOB_STOPPED) {
+                // Nothing can resume it from here, and waiting would hang the batch
+                fprintf(stderr, "[%d] Stopped; terminating  %s\n", run->job->id, run->job->command);
+                kill(-run->job->pgid, SIGTERM);
+                kill(-run->job->pgid, SIGCONT);
+                run->job->state = JOB_RUNNING;
+            }
+            if (run->job != NULL && run->job->state == JOB_DONE) {
+                summarizeJobUsage(run->job, &run->usage);
+                run->status = exitCode(run->job->processes[run->job->numProcesses - 1].status);
+                removeJob(run->job);
+                run->job = NULL;
+                run->finished = 1;
+                running--;
+                finishedNow++;
+            }
+            if (run->finished && run->status != 0 && batch->haltOnFailure) {
+                // Start nothing more; what is already running finishes
+                halted = 1;
+            }
+        }
+
+        if (batch->keepOrder) {
+            while (printed < next && runs[printed].finished) {
+                printCapturedRun(&runs[printed++], batch);
+            }
+        } else {
+            for (int i = 0; i < next; i++) {
+                if (runs[i].finished && !runs[i].printed) {
+                    runs[i].printed = 1;
+                    printCapturedRun(&runs[i], batch);
+                    printed++;
+                }
+            }
+        }
+
+        if (finishedNow == 0 && printed < (halted ? next : batch->count)) {
+            sigset_t waitMask = saved;
+            sigdelset(&waitMask, SIGCHLD);
+            sigdelset(&waitMask, SIGINT);
+            sigdelset(&waitMask, SIGTERM);
+            sigsuspend(&waitMask);
+        }
+    }
+    sigaction(SIGINT, &savedInt, NULL);
+    sigaction(SIGTERM, &savedTerm, NULL);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    if (nullFd != -1) {
+        close(nullFd);
+    }
+    batch->started = next;
+    return runs;
+}
+
+void releaseBookmarkImage(struct BookmarkStore *store) {
+    if (store->mapped) {
+        munmap(store->image, store->size);
+    } else {
+        free(store->image);
+    }
+    for (int i = 0; i < store->count; i++) {
+        free(store->items[i].argv);
+    }
+    free(store->items);
+    store->image = NULL;
+    store->size = 0;
+    store->mapped = 0;
+    store->items = NULL;
+    store->count = 0;
+}
+
+// Build the in-memory index over an image. Every length is checked against
+// the record it came from, so a truncated or foreign file is rejected
+// rather than read past its end.
+int indexBookmarkImage(struct BookmarkStore *store, char *image, size_t size) {
+    struct BookmarkFileHeader *header = (struct BookmarkFileHeader *) image;
+    if (size < sizeof(*header) || memcmp(header->magic, BOOKMARK_MAGIC, sizeof(BOOKMARK_MAGIC)) != 0 ||
+        header->size != size) {
+        return -1;
+    }
+
+    struct Bookmark *items = calloc(header->count ? header->count : 1, sizeof(struct Bookmark));
+    size_t offset = sizeof(*header);
+    uint32_t count;
+    for (count = 0; count < header->count; count++) {
+        struct BookmarkRecord *record = (struct BookmarkRecord *) (image + offset);
+        if (size - offset < sizeof(*record) || record->size < sizeof(*record) || record->size > size - offset ||
+            (uint64_t) record->nameLen + record->commandLen + record->pathLen + 3 + record->argsLen >
+                    record->size - sizeof(*record) || record->argc == 0) {
+            break;
+        }
+        char *strings = (char *) (record + 1);
+        char *command = strings + record->nameLen + 1;
+        char *path = command + record->commandLen + 1;
+        char *arg = path + record->pathLen + 1;
+        char *end = arg + record->argsLen;
+        if (strings[record->nameLen] != '\0' || command[record->commandLen] != '\0' || path[record->pathLen] != '\0') {
+            break;
+        }
+
+        struct Bookmark *bookmark = &items[count];
+        bookmark->argv = malloc((record->argc + 1) * sizeof(char *));
+        for (int i = 0; i < record->argc; i++) {
+            char *nul = arg < end ? memchr(arg, '\0', end - arg) : NULL;
+            if (nul == NULL) {
+                break;
+            }
+            bookmark->argv[bookmark->argc++] = arg;
+            arg = nul + 1;
+        }
+        bookmark->argv[bookmark->argc] = NULL;
+        if (bookmark->argc != record->argc) {
+            free(bookmark->argv);
+            break;
+        }
+        bookmark->name = strings;
+        bookmark->command = command;
+        bookmark->path = path;
+        bookmark->background = record->background;
+        offset += record->size;
+    }
+    if (count != header->count) {
+        for (uint32_t i = 0; i < count; i++) {
+            free(items[i].argv);
+        }
+        free(items);
+        return -1;
+    }
+
+    store->image = image;
+    store->size = size;
+    store->items = items;
+    store->count = (int) count;
+    return 0;
+}
+
+void rememberBookmarkFile(struct BookmarkStore *store, struct stat *st) {
+    store->dev = st->st_dev;
+    store->ino = st->st_ino;
+    store->fileSize = st->st_size;
+    store->mtime = st->st_mtim;
+}
+
+// Map the store written by this or another shell. A missing file is an
+// empty store; a damaged one is reported and left alone until the next
+// change replaces it.
+void loadBookmarkStore() {
+    struct BookmarkStore *store = &bookmarkStore;
+    if (store->filename == NULL) {
+        const char *file = getenv("OPSHELL_BOOKMARKS");
+        const char *home = getenv("HOME");
+        if (file != NULL && *file != '\0') {
+            store->filename = strdup(file);
+        } else if (home != NULL) {
+            store->filename = malloc(strlen(home) + sizeof(BOOKMARK_FILE) + 1);
+            sprintf(store->filename, "%s/%s", home, BOOKMARK_FILE);
+        } else {
+            return;  // Bookmarks last for this session only
+        }
+    }
+
+    releaseBookmarkImage(store);
+    struct stat st = {0};
+    rememberBookmarkFile(store, &st);
+    int fd = open(store->filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return;
+    }
+    rememberBookmarkFile(store, &st);
+    // Private and writable: argv strings may be edited in place by the
+    // command that runs them, but never reach the file
+    char *map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "bookmark: cannot read %s\n", store->filename);
+        return;
+    }
+    if (indexBookmarkImage(store, map, st.st_size) == -1) {
+        fprintf(stderr, "bookmark: ignoring damaged %s\n", store->filename);
+        munmap(map, st.st_size);
+        return;
+    }
+    store->mapped = 1;
+}
+
+// Pick up changes another shell made since the store was loaded
+void refreshBookmarkStore() {
+    struct BookmarkStore *store = &bookmarkStore;
+    struct stat st;
+    if (store->filename == NULL) {
+        return;
+    }
+    if (stat(store->filename, &st) == -1) {
+        if (store->ino != 0) {
+            loadBookmarkStore();
+        }
+        return;
+    }
+    if (st.st_dev != store->dev || st.st_ino != store->ino || st.st_size != store->fileSize ||
+        st.st_mtim.tv_sec != store->mtime.tv_sec || st.st_mtim.tv_nsec != store->mtime.tv_nsec) {
+        loadBookmarkStore();
+    }
+}
+
+// Serialize items into a fresh image, rename it over the file and switch
+// the store to it. items may point into the current image, so that is
+// only released once the new one is built. If the file cannot be written
+// the change still holds for this session.
+void saveBookmarks(struct Bookmark *items, int count) {
+    struct BookmarkStore *store = &bookmarkStore;
+    size_t size = sizeof(struct BookmarkFileHeader);
+    for (int i = 0; i < count; i++) {
+        size_t len = sizeof(struct BookmarkRecord) + strlen(items[i].name) + strlen(items[i].command) +
+                     strlen(items[i].path) + 3;
+        for (int k = 0; k < items[i].argc; k++) {
+            len += strlen(items[i].argv[k]) + 1;
+        }
+        size += (len + 7) & ~(size_t) 7;
+    }
+
+    char *image = calloc(1, size);
+    struct BookmarkFileHeader *header = (struct BookmarkFileHeader *) image;
+    memcpy(header->magic, BOOKMARK_MAGIC, sizeof(BOOKMARK_MAGIC));
+    header->count = (uint32_t) count;
+    header->size = size;
+    size_t offset = sizeof(*header);
+    for (int i = 0; i < count; i++) {
+        struct BookmarkRecord *record = (struct BookmarkRecord *) (image + offset);
+        char *out = (char *) (record + 1);
+        record->argc = (uint16_t) items[i].argc;
+        record->background = (uint8_t) items[i].background;
+        record->nameLen = (uint32_t) strlen(items[i].name);
+        record->commandLen = (uint32_t) strlen(items[i].command);
+        record->pathLen = (uint32_t) strlen(items[i].path);
+        out = stpcpy(out, items[i].name) + 1;
+        out = stpcpy(out, items[i].command) + 1;
+        out = stpcpy(out, items[i].path) + 1;
+        char *args = out;
+        for (int k = 0; k < items[i].argc; k++) {
+            out = stpcpy(out, items[i].argv[k]) + 1;
+        }
+        record->argsLen = (uint32_t) (out - args);
+        record->size = (uint32_t) (((out - (char *) record) + 7) & ~(size_t) 7);
+        offset += record->size;
+    }
+
+    // Write next to the old store and rename over it so a crash or a
+    // concurrent shell never sees a partial file
+    int saved = 0;
+    if (store->filename != NULL) {
+        char *tmpName = malloc(strlen(store->filename) + 16);
+        sprintf(tmpName, "%s.%d", store->filename, (int) getpid());
+        int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd != -1 && writeOutput(fd, image, size) == 0 && fsync(fd) == 0 && close(fd) == 0 &&
+            rename(tmpName, store->filename) == 0) {
+            saved = 1;
+        } else {
+            perror("bookmark");
+            if (fd != -1) {
+                close(fd);
+                unlink(tmpName);
+            }
+        }
+        free(tmpName);
+    }
+
+    releaseBookmarkImage(store);
+    indexBookmarkImage(store, image, size);
+    struct stat st;
+    if (saved && stat(store->filename, &st) == 0) {
+        rememberBookmarkFile(store, &st);
+    }
+}
+
+// An index, or else the name of a bookmark
+int findBookmark(const char *key) {
+    char *end;
+    long index = strtol(key, &end, 10);
+    if (*key != '\0' && *end == '\0') {
+        return index >= 0 && index < bookmarkStore.count ? (int) index : -1;
+    }
+    for (int i = 0; i < bookmarkStore.count; i++) {
+        if (strcmp(bookmarkStore.items[i].name, key) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Tokenize once, here, and keep the result. A plain external command also
+// keeps its resolved path so replaying it needs neither the parser nor PATH.
+void addBookmark(const char *name, char *words[]) {
+    int background = 0;
+    char *command = words[1] == NULL ? trimQuotes(words[0]) : joinArgs(words);
+    char *line = arenaStrdup(&commandArena, command);
+    char **argv = setup(line, strlen(line), &background);
+    if (argv[0] == NULL) {
+        printf("Usage: bookmark [-n name] <command>\n");
+        if (words[1] != NULL) {
+            free(command);
+        }
+        return;
+    }
+
+    struct Bookmark bookmark = {name, command, "", argv, 0, background};
+    while (argv[bookmark.argc] != NULL) {
+        bookmark.argc++;
+    }
+    if (!isPipeline(argv) && !isBuiltinCommand(argv[0])) {
+        const char *path = lookupCommandPath(argv[0]);
+        bookmark.path = path != NULL ? path : "";
+    }
+
+    struct BookmarkStore *store = &bookmarkStore;
+    struct Bookmark *items = malloc((store->count + 1) * sizeof(struct Bookmark));
+    memcpy(items, store->items, store->count * sizeof(struct Bookmark));
+    int count = store->count;
+    int slot = *name != '\0' ? findBookmark(name) : -1;
+    if (slot >= 0) {
+        items[slot] = bookmark;  // Redefining a name keeps its position
+    } else {
+        items[count++] = bookmark;
+    }
+    saveBookmarks(items, count);
+    free(items);
+    if (words[1] != NULL) {
+        free(command);
+    }
+}
+
+void runBookmark(int index) {
+    struct Bookmark *bookmark = &bookmarkStore.items[index];
+    // The command may rewrite its argv, so it gets its own pointer array
+    char **args = arenaAlloc(&commandArena, (bookmark->argc + 1) * sizeof(char *));
+    memcpy(args, bookmark->argv, (bookmark->argc + 1) * sizeof(char *));
+
+    if (*bookmark->path == '\0') {
+        runCommand(args, bookmark->background);
+        return;
+    }
+    if (access(bookmark->path, X_OK) == -1) {
+        // Moved or uninstalled since it was saved: resolve again and remember
+        const char *path = lookupCommandPath(args[0]);
+        if (path == NULL) {
+            fprintf(stderr, "Command not found: %s\n", args[0]);
+            lastStatus = 127;
+            return;
+        }
+        char *commandPath = arenaStrdup(&commandArena, path);
+        struct Bookmark *items = malloc(bookmarkStore.count * sizeof(struct Bookmark));
+        memcpy(items, bookmarkStore.items, bookmarkStore.count * sizeof(struct Bookmark));
+        items[index].path = commandPath;
+        // The new image must not borrow from the one being replaced
+        for (int i = 0; i < bookmark->argc; i++) {
+            args[i] = arenaStrdup(&commandArena, args[i]);
+        }
+        saveBookmarks(items, bookmarkStore.count);
+        free(items);
+        struct IORedirection redirection;
+        handleIOredirection(args, &redirection);
+        launchExternalCommand(commandPath, args, bookmarkStore.items[index].background, &redirection);
+        return;
+    }
+
+    struct IORedirection redirection;
+    handleIOredirection(args, &redirection);
+    launchExternalCommand(bookmark->path, args, bookmark->background, &redirection);
+}
+
+// Start one bookmark of a parallel run. Plain commands are launched
+// directly; pipelines and builtins run in a forked copy of the shell, as a
+// subshell would.
+void startBookmarkRun(struct CapturedRun *run, int nullFd, void *context) {
+    struct Bookmark *bookmark = &bookmarkStore.items[((int *) context)[run->index]];
+    char **args = arenaAlloc(&commandArena, (bookmark->argc + 1) * sizeof(char *));
+    memcpy(args, bookmark->argv, (bookmark->argc + 1) * sizeof(char *));
+
+    if (*bookmark->path != '\0' && access(bookmark->path, X_OK) == 0) {
+        struct IORedirection redirection;
+        handleIOredirection(args, &redirection);
+        startCapturedCommand(run, bookmark->path, args, &redirection, nullFd);
+        return;
+    }
+
+    pid_t pid = -1;
+    run->outputFd = memfd_create("captured", MFD_CLOEXEC);
+    if (run->outputFd == -1) {
+        perror("memfd_create");
+    } else {
+        run->job = createJob(strdup(bookmark->command), 0);
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            setpgid(0, 0);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+            dup2(nullFd, STDIN_FILENO);
+            dup2(run->outputFd, STDOUT_FILENO);
+            dup2(run->outputFd, STDERR_FILENO);
+            interactive = 0;
+            runCommand(args, 0);
+            exit(lastStatus);
+        }
+        if (pid > 0) {
+            // From both sides, so the group exists before anyone signals it
+            setpgid(pid, pid);
+        } else {
+            perror("fork");
+        }
+    }
+    trackCapturedRun(run, pid, args[0]);
+}
+
+void printBookmarkRunHeader(struct CapturedRun *run, void *context) {
+    int index = ((int *) context)[run->index];
+    printf("==> %d \"%s\" <==\n", index, bookmarkStore.items[index].command);
+}
+
+// "bookmark -i 0 3 5 -j 4": at most limit bookmarks at a time, each as its
+// own job, with outputs in the order the bookmarks were given and a
+// summary of how each one went
+void runBookmarksInParallel(int *indexes, int count, int limit) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct CapturedBatch batch = {count, limit, 1, 0, startBookmarkRun, printBookmarkRunHeader, indexes, 0};
+    struct CapturedRun *runs = runCapturedJobs(&batch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0;
+    lastStatus = 0;
+    printf("==> summary <==\n");
+    for (int i = 0; i < count; i++) {
+        struct CapturedRun *run = &runs[i];
+        printf("%d exit %-3d real %.3fs  user %.3fs  sys %.3fs  %s\n", indexes[i], run->status,
+               run->usage.wallSeconds,
+               run->usage.usage.ru_utime.tv_sec + run->usage.usage.ru_utime.tv_usec / 1e6,
+               run->usage.usage.ru_stime.tv_sec + run->usage.usage.ru_stime.tv_usec / 1e6,
+               bookmarkStore.items[indexes[i]].command);
+        if (run->status != 0 && failed++ == 0) {
+            lastStatus = run->status;
+        }
+    }
+    printf("%d bookmarks, %d failed, %.3fs\n", count, failed, secondsBetween(&start, &end));
+    free(runs);
+}
+
+void handleBookmarkCommand(char *args[]) {
+    refreshBookmarkStore();
+    if (args[1] == NULL) {
+        printf("Usage: bookmark [-n name] <command>\n");
+    } else if (strcmp(args[1], "-l") == 0) {
+        printBookmarks();
+    } else if (strcmp(args[1], "-i") == 0) {
+        int count = 0, limit = 0, numArgs = 0;
+        while (args[numArgs] != NULL) {
+            numArgs++;
+        }
+        int *indexes = arenaAlloc(&commandArena, numArgs * sizeof(int));
+        for (int i = 2; args[i] != NULL; i++) {
+            if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+                limit = atoi(args[++i]);
+                if (limit <= 0) {
+                    printf("Usage: bookmark -i <index|name>... [-j <jobs>]\n");
+                    return;
+                }
+                continue;
+            }
+            int index = findBookmark(args[i]);
+            if (index < 0) {
+                printf("Invalid bookmark index.\n");
+                return;
+            }
+            indexes[count++] = index;
+        }
+        if (count == 0) {
+            printf("Usage: bookmark -i <index|name>... [-j <jobs>]\n");
+        } else if (count == 1 && limit == 0) {
+            runBookmark(indexes[0]);
+        } else {
+            runBookmarksInParallel(indexes, count, limit ? limit : (int) sysconf(_SC_NPROCESSORS_ONLN));
+        }
+    } else if (strcmp(args[1], "-d") == 0) {
+        if (args[2] != NULL) {
+            int index = findBookmark(args[2]);
+            if (index >= 0) {
+                struct Bookmark *items = malloc(bookmarkStore.count * sizeof(struct Bookmark));
+                memcpy(items, bookmarkStore.items, index * sizeof(struct Bookmark));
+                memcpy(items + index, bookmarkStore.items + index + 1,
+                       (bookmarkStore.count - index - 1) * sizeof(struct Bookmark));
+                saveBookmarks(items, bookmarkStore.count - 1);
+                free(items);
+            } else {
+                printf("Invalid bookmark index.\n");
+            }
+        } else {
+            printf("Usage: bookmark -d <index|name>\n");
+        }
+    } else if (strcmp(args[1], "-n") == 0) {
+        if (args[2] != NULL && args[3] != NULL && !isdigit((unsigned char) args[2][0])) {
+            addBookmark(args[2], &args[3]);
+        } else {
+            printf("Usage: bookmark -n <name> <command>\n");
+        }
+    } else {
+        addBookmark("", &args[1]);
+    }
+}
+
+void printBookmarks() {
+    for (int i = 0; i < bookmarkStore.count; i++) {
+        struct Bookmark *bookmark = &bookmarkStore.items[i];
+        if (*bookmark->name != '\0') {
+            printf("%d %s \"%s\"\n", i, bookmark->name, bookmark->command);
+        } else {
+            printf("%d \"%s\"\n", i, bookmark->command);
+        }
+    }
+}
+
+struct HistoryRecord *historyRecord(uint32_t entry) {
+    return (struct HistoryRecord *) (historyStore.image + historyStore.entries[entry]);
+}
+
+const char *historyText(uint32_t entry) {
+    return (const char *) (historyRecord(entry) + 1);
+}
+
+// Spread a 24-bit trigram over the posting buckets
+uint32_t historyBucket(uint32_t trigram) {
+    return (trigram * 2654435761u) >> (32 - HISTORY_TRIGRAM_BITS);
+}
+
+// A new distinct line: its trigrams point at it from now on
+void addHistoryPostings(uint32_t line, const char *text) {
+    size_t len = strlen(text);
+    for (size_t i = 2; i < len; i++) {
+        uint32_t trigram = ((uint8_t) text[i - 2] << 16) | ((uint8_t) text[i - 1] << 8) | (uint8_t) text[i];
+        struct HistoryPostings *list = &historyStore.postings[historyBucket(trigram)];
+        if (list->count > 0 && list->lines[list->count - 1] == line) {
+            continue;  // Repeated trigram, or a bucket collision within the line
+        }
+        if (list->count == list->cap) {
+            list->cap = list->cap ? list->cap * 2 : 8;
+            list->lines = realloc(list->lines, list->cap * sizeof(uint32_t));
+        }
+        list->lines[list->count++] = line;
+    }
+}
+
+// Rebuild the line table at twice the size
+void growHistoryTable() {
+    struct HistoryStore *store = &historyStore;
+    uint32_t size = store->tableSize ? store->tableSize * 2 : 1 << 12;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    for (uint32_t line = 0; line < store->numLines; line++) {
+        uint32_t slot = hashCommandName(historyText(store->latest[line])) & (size - 1);
+        while (table[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        table[slot] = line + 1;
+    }
+    free(store->lineTable);
+    store->lineTable = table;
+    store->tableSize = size;
+}
+
+// The line table slot holding text, or the empty slot where it would go
+uint32_t findHistoryLine(const char *text) {
+    struct HistoryStore *store = &historyStore;
+    uint32_t slot = hashCommandName(text) & (store->tableSize - 1);
+    while (store->lineTable[slot] != 0 &&
+           strcmp(historyText(store->latest[store->lineTable[slot] - 1]), text) != 0) {
+        slot = (slot + 1) & (store->tableSize - 1);
+    }
+    return slot;
+}
+
+// File one parsed record under its distinct line, adding the line if new
+void indexHistoryEntry(uint32_t entry) {
+    struct HistoryStore *store = &historyStore;
+    if (store->numLines * 2 >= store->tableSize) {
+        growHistoryTable();
+    }
+    const char *text = historyText(entry);
+    uint32_t slot = findHistoryLine(text);
+    if (store->lineTable[slot] != 0) {
+        store->latest[store->lineTable[slot] - 1] = entry;
+        return;
+    }
+    if (store->numLines == store->linesCap) {
+        store->linesCap = store->linesCap ? store->linesCap * 2 : 1024;
+        store->latest = realloc(store->latest, store->linesCap * sizeof(uint32_t));
+    }
+    store->latest[store->numLines] = entry;
+    store->lineTable[slot] = store->numLines + 1;
+    addHistoryPostings(store->numLines, text);
+    store->numLines++;
+}
+
+// A whole, well-formed record in the left bytes at record: its text is
+// NUL-terminated and exactly fills it, padding aside
+int isHistoryRecord(const struct HistoryRecord *record, size_t left) {
+    if (record->magic != HISTORY_MAGIC || record->size % 8 != 0 || record->size <= sizeof(*record) ||
+        record->size > left) {
+        return 0;
+    }
+    const char *text = (const char *) (record + 1);
+    size_t len = strnlen(text, record->size - sizeof(*record));
+    return ((sizeof(*record) + len + 1 + 7) & ~(size_t) 7) == record->size;
+}
+
+// The first 8-byte aligned offset from on that holds HISTORY_MAGIC, or
+// the end of the mapped log
+size_t nextHistoryRecord(struct HistoryStore *store, size_t from) {
+    for (; from + sizeof(uint32_t) <= store->mapped; from += 8) {
+        if (*(uint32_t *) (store->image + from) == HISTORY_MAGIC) {
+            return from;
+        }
+    }
+    return store->mapped;
+}
+
+// Map whatever this and other shells have appended since the last look
+// and index the new records. A record that runs past the end is not
+// complete yet and is picked up on a later call; anything else that does
+// not parse is skipped up to the next aligned magic.
+void refreshHistory() {
+    struct HistoryStore *store = &historyStore;
+    struct stat st;
+    if (store->fd == -1 || fstat(store->fd, &st) == -1 || (size_t) st.st_size <= store->mapped) {
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    if (store->image != NULL) {
+        munmap(store->image, store->mapped);
+    }
+    store->image = map;
+    store->mapped = st.st_size;
+
+    while (store->parsed + sizeof(struct HistoryRecord) <= store->mapped) {
+        struct HistoryRecord *record = (struct HistoryRecord *) (store->image + store->parsed);
+        size_t left = store->mapped - store->parsed;
+        if (!isHistoryRecord(record, left)) {
+            // A torn write or a foreign one: resynchronize on the next
+            // record. One that merely runs past the end may still be
+            // arriving, unless another has been appended after it.
+            size_t next = nextHistoryRecord(store, store->parsed + 8);
+            int truncated = record->magic == HISTORY_MAGIC && record->size % 8 == 0 &&
+                            record->size > sizeof(*record) && record->size > left;
+            if (truncated && next == store->mapped) {
+                break;
+            }
+            store->parsed = next;
+            continue;
+        }
+        if (store->count == store->cap) {
+            store->cap = store->cap ? store->cap * 2 : 1024;
+            store->entries = realloc(store->entries, store->cap * sizeof(uint64_t));
+        }
+        store->entries[store->count] = store->parsed;
+        indexHistoryEntry(store->count++);
+        store->parsed += record->size;
+    }
+}
+
+void loadHistory() {
+    struct HistoryStore *store = &historyStore;
+    const char *file = getenv("OPSHELL_HISTORY");
+    const char *home = getenv("HOME");
+    if (file != NULL && *file != '\0') {
+        store->filename = strdup(file);
+    } else if (home != NULL) {
+        store->filename = malloc(strlen(home) + sizeof(HISTORY_FILE) + 1);
+        sprintf(store->filename, "%s/%s", home, HISTORY_FILE);
+    } else {
+        return;  // No history
+    }
+    store->fd = open(store->filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (store->fd == -1) {
+        fprintf(stderr, "history: %s: %s\n", store->filename, strerror(errno));
+        return;
+    }
+    store->postings = calloc(HISTORY_TRIGRAM_BUCKETS, sizeof(struct HistoryPostings));
+    refreshHistory();
+}
+
+// Log a finished command. One O_APPEND write per record keeps concurrent
+// shells from interleaving inside each other's entries.
+void addHistory(const char *line, int status, time_t started, double seconds) {
+    if (historyStore.fd == -1) {
+        return;
+    }
+    size_t size = (sizeof(struct HistoryRecord) + strlen(line) + 1 + 7) & ~(size_t) 7;
+    struct HistoryRecord *record = arenaAlloc(&commandArena, size);
+    memset(record, 0, size);
+    record->magic = HISTORY_MAGIC;
+    record->size = size;
+    record->started = started;
+    record->durationNs = (uint64_t) (seconds * 1e9);
+    record->status = status;
+    strcpy((char *) (record + 1), line);
+    if (write(historyStore.fd, record, size) != (ssize_t) size) {
+        perror("history");
+    }
+}
+
+// The newest entry before entry "before" whose line contains text, or
+// starts with it when prefix is set; -1 if there is none. Each distinct
+// line is considered once, at its newest entry, so repeated commands
+// show up once as the search walks back. Queries of three or more bytes
+// only look at the lines in their rarest trigram's bucket; shorter ones
+// walk back from the newest entry, which usually matches soon.
+int64_t findHistoryEntry(const char *text, uint32_t before, int prefix) {
+    struct HistoryStore *store = &historyStore;
+    size_t len = strlen(text);
+    if (store->count == 0) {
+        return -1;
+    }
+    if (len < 3) {
+        for (uint32_t entry = before; entry-- > 0;) {
+            const char *line = historyText(entry);
+            if ((prefix ? strncmp(line, text, len) == 0 : strstr(line, text) != NULL) &&
+                store->latest[store->lineTable[findHistoryLine(line)] - 1] == entry) {
+                return entry;
+            }
+        }
+        return -1;
+    }
+    const uint32_t *candidates = NULL;
+    uint32_t numCandidates = store->numLines;
+    for (size_t i = 2; i < len; i++) {
+        uint32_t trigram = ((uint8_t) text[i - 2] << 16) | ((uint8_t) text[i - 1] << 8) | (uint8_t) text[i];
+        struct HistoryPostings *list = &store->postings[historyBucket(trigram)];
+        if (candidates == NULL || list->count < numCandidates) {
+            candidates = list->lines;
+            numCandidates = list->count;
+        }
+    }
+
+    int64_t best = -1;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+        uint32_t entry = store->latest[candidates[i]];
+        if (entry >= before || (int64_t) entry <= best) {
+            continue;
+        }
+        const char *line = historyText(entry);
+        if (prefix ? strncmp(line, text, len) == 0 : strstr(line, text) != NULL) {
+            best = entry;
+        }
+    }
+    return best;
+}
+
+// Replace a leading !!, !n, !-n or !prefix with the entry it names.
+// Returns the line unchanged if it has no such event, or NULL with a
+// message if the event does not exist.
+char *expandHistory(char *line, size_t *length) {
+    if (line[0] != '!' || line[1] == '\0' || strchr(" \t=(", line[1]) != NULL) {
+        return line;
+    }
+    size_t end = 1;
+    while (line[end] != '\0' && line[end] != ' ' && line[end] != '\t') {
+        end++;
+    }
+    char *event = arenaAlloc(&commandArena, end);
+    memcpy(event, line + 1, end - 1);
+    event[end - 1] = '\0';
+
+    uint32_t count = historyStore.count;
+    int64_t entry = -1;
+    char *digits;
+    if (strcmp(event, "!") == 0) {
+        entry = (int64_t) count - 1;
+    } else if ((event[0] == '-' && isdigit((unsigned char) event[1])) || isdigit((unsigned char) event[0])) {
+        long n = strtol(event, &digits, 10);
+        if (*digits == '\0') {
+            entry = n < 0 ? (int64_t) count + n : n - 1;
+        }
+        if (entry >= count) {
+            entry = -1;
+        }
+    } else {
+        entry = findHistoryEntry(event, count, 1);
+    }
+    if (entry < 0) {
+        fprintf(stderr, "!%s: event not found\n", event);
+        return NULL;
+    }
+
+    const char *text = historyText(entry);
+    size_t textLen = strlen(text);
+    *length = textLen + strlen(line + end);
+    char *expanded = arenaAlloc(&commandArena, *length + 1);
+    memcpy(expanded, text, textLen);
+    strcpy(expanded + textLen, line + end);
+    printf("%s\n", expanded);
+    return expanded;
+}
+
+void printHistoryEntry(uint32_t entry) {
+    struct HistoryRecord *record = historyRecord(entry);
+    time_t started = record->started;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+    printf("%6u  %s  %8.3fs  %3d  %s\n", entry + 1, when, record->durationNs / 1e9, record->status,
+           historyText(entry));
+}
+
+// history [N]: the last N entries, or all of them
+// history -s text [N]: the newest N distinct lines containing text
+void handleHistoryCommand(char *args[]) {
+    refreshHistory();
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL) {
+            printf("Usage: history [-s text] [N]\n");
+            return;
+        }
+        int limit = args[3] != NULL ? atoi(args[3]) : 20;
+        uint32_t before = historyStore.count;
+        for (int shown = 0; shown < limit; shown++) {
+            int64_t entry = findHistoryEntry(args[2], before, 0);
+            if (entry < 0) {
+                break;
+            }
+            printHistoryEntry(entry);
+            before = entry;
+        }
+        return;
+    }
+    uint32_t count = historyStore.count;
+    uint32_t first = 0;
+    if (args[1] != NULL && atoi(args[1]) > 0 && (uint32_t) atoi(args[1]) < count) {
+        first = count - atoi(args[1]);
+    }
+    for (uint32_t entry = first; entry < count; entry++) {
+        printHistoryEntry(entry);
+    }
+}
+
+// Replace every {} in word with item
+char *substituteItem(const char *word, const char *item) {
+    const char *mark = strstr(word, "{}");
+    if (mark == NULL) {
+        return (char *) word;
+    }
+    size_t itemLen = strlen(item);
+    size_t len = strlen(word);
+    for (const char *p = mark; p != NULL; p = strstr(p + 2, "{}")) {
+        len += itemLen - 2;
+    }
+    char *out = arenaAlloc(&commandArena, len + 1);
+    char *dst = out;
+    while (mark != NULL) {
+        memcpy(dst, word, mark - word);
+        dst += mark - word;
+        memcpy(dst, item, itemLen);
+        dst += itemLen;
+        word = mark + 2;
+        mark = strstr(word, "{}");
+    }
+    strcpy(dst, word);
+    return out;
+}
+
+// Build one job's argv from the template; the path was resolved up front
+void startParallelRun(struct CapturedRun *run, int nullFd, void *context) {
+    struct ParallelCommand *command = context;
+    const char *item = command->items[run->index];
+    char **args = arenaAlloc(&commandArena, (command->numWords + 2) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < command->numWords; i++) {
+        args[n++] = substituteItem(command->words[i], item);
+    }
+    if (command->appendItem) {
+        args[n++] = (char *) item;
+    }
+    args[n] = NULL;
+    startCapturedCommand(run, command->commandPath, args, NULL, nullFd);
+}
+
+// Arguments one per line, from a file or the shell's own stdin
+int readParallelItems(const char *filename, char ***items) {
+    struct LineReader reader;
+    int fd = STDIN_FILENO;
+    if (filename != NULL && (fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror(filename);
+        return -1;
+    }
+    initLineReader(&reader, fd);
+    int count = 0, cap = 64;
+    *items = malloc(cap * sizeof(char *));
+    char *line;
+    size_t length;
+    while ((line = readLine(&reader, &length)) != NULL) {
+        if (length == 0) {
+            continue;
+        }
+        if (count == cap) {
+            cap *= 2;
+            *items = realloc(*items, cap * sizeof(char *));
+        }
+        (*items)[count++] = arenaStrdup(&commandArena, line);
+    }
+    free(reader.buf);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return count;
+}
+
+// parallel [-j N] [-k] [--halt] command [args with {}] [::: items... | :::: file]
+void handleParallelCommand(char *args[]) {
+    int limit = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int keepOrder = 0, haltOnFailure = 0;
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && atoi(args[i + 1]) > 0) {
+            limit = atoi(args[++i]);
+        } else if (strcmp(args[i], "-k") == 0) {
+            keepOrder = 1;
+        } else if (strcmp(args[i], "--halt") == 0) {
+            haltOnFailure = 1;
+        } else {
+            break;
+        }
+    }
+
+    struct ParallelCommand command = {NULL, &args[i], 0, NULL, 1};
+    while (args[i] != NULL && strcmp(args[i], ":::") != 0 && strcmp(args[i], "::::") != 0) {
+        if (strstr(args[i], "{}") != NULL) {
+            command.appendItem = 0;
+        }
+        command.numWords++;
+        i++;
+    }
+    if (command.numWords == 0 || (args[i] != NULL && strcmp(args[i], "::::") == 0 &&
+                                  (args[i + 1] == NULL || args[i + 2] != NULL))) {
+        printf("Usage: parallel [-j N] [-k] [--halt] command [args with {}] [::: items... | :::: file]\n");
+        return;
+    }
+    command.commandPath = lookupCommandPath(command.words[0]);
+    if (command.commandPath == NULL) {
+        fprintf(stderr, "Command not found: %s\n", command.words[0]);
+        lastStatus = 127;
+        return;
+    }
+
+    int count;
+    char **itemList = NULL;
+    if (args[i] != NULL && strcmp(args[i], ":::") == 0) {
+        command.items = &args[i + 1];
+        for (count = 0; command.items[count] != NULL; count++) {
+        }
+    } else {
+        count = readParallelItems(args[i] != NULL ? args[i + 1] : NULL, &itemList);
+        if (count == -1) {
+            lastStatus = 1;
+            return;
+        }
+        command.items = itemList;
+    }
+    // Copy the path out of the cache: a failed launch may evict it
+    command.commandPath = arenaStrdup(&commandArena, command.commandPath);
+
+    struct CapturedBatch batch = {count, limit, keepOrder, haltOnFailure, startParallelRun, NULL, &command, 0};
+    struct CapturedRun *runs = runCapturedJobs(&batch);
+    lastStatus = 0;
+    for (int k = 0; k < batch.started; k++) {
+        if (runs[k].status != 0) {
+            lastStatus = runs[k].status;
+            break;
+        }
+    }
+    free(runs);
+    free(itemList);
+}
+
+void appendOutput(struct OutputBuffer *out, const char *data, size_t len) {
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        while (cap < out->len + len) {
+            cap *= 2;
+        }
+        out->data = realloc(out->data, cap);
+        out->cap = cap;
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+// write() all of it, retrying after signals and short writes
+int writeOutput(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef SEARCH_SIMD
+// Candidate filter in the style of the "generic SIMD" strstr: compare the
+// needle's first and last bytes against 16/32 haystack positions at once and
+// only memcmp the middle where both agree. Needles are at least 2 bytes.
+const char *findSubstringSSE2(const char *hay, size_t n, const char *needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i *) (hay + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                                        _mm_cmpeq_epi8(last, blockLast)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return i < n ? memmem(hay + i, n - i, needle, m) : NULL;
+}
+
+__attribute__((target("avx2")))
+const char *findSubstringAVX2(const char *hay, size_t n, const char *needle, size_t m) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i *) (hay + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i *) (hay + i + m - 1));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                                                                         _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return i < n ? findSubstringSSE2(hay + i, n - i, needle, m) : NULL;
+}
+#endif
+
+const char *findSubstring(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 1) {
+        return memchr(hay, needle[0], n);
+    }
+    if (m > n) {
+        return NULL;
+    }
+#ifdef SEARCH_SIMD
+    static int haveAVX2 = -1;
+    if (haveAVX2 < 0) {
+        haveAVX2 = __builtin_cpu_supports("avx2");
+    }
+    return haveAVX2 ? findSubstringAVX2(hay, n, needle, m) : findSubstringSSE2(hay, n, needle, m);
+#else
+    return memmem(hay, n, needle, m);
+#endif
+}
+
+size_t countNewlines(const char *p, const char *end) {
+    size_t count = 0;
+#ifdef SEARCH_SIMD
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+#endif
+    for (; p < end; p++) {
+        count += *p == '\n';
+    }
+    return count;
+}
+
+// Compile patterns into matcher. One pattern is matched with
+// findSubstring(); several become an Aho-Corasick automaton, flattened to
+// a full DFA so the scan is one table lookup per byte. Bytes that occur in
+// no pattern share class 0, which keeps rows as narrow as the alphabet the
+// patterns actually use.
+void compileSearchMatcher(char **patterns, int numPatterns, struct SearchMatcher *matcher) {
+    memset(matcher, 0, sizeof(*matcher));
+    matcher->patterns = patterns;
+    matcher->numPatterns = numPatterns;
+    matcher->lengths = malloc((numPatterns ? numPatterns : 1) * sizeof(size_t));
+    size_t totalLen = 0;
+    for (int i = 0; i < numPatterns; i++) {
+        matcher->lengths[i] = strlen(patterns[i]);
+        totalLen += matcher->lengths[i];
+    }
+    if (numPatterns < 2) {
+        return;
+    }
+
+    int numClasses = 1;
+    for (int i = 0; i < numPatterns; i++) {
+        for (size_t j = 0; j < matcher->lengths[i]; j++) {
+            unsigned char c = patterns[i][j];
+            if (matcher->classes[c] == 0) {
+                matcher->classes[c] = numClasses++;
+            }
+        }
+        if (matcher->lengths[i] > 0) {
+            unsigned char first = patterns[i][0];
+            matcher->startBytes[first] = 1;
+            matcher->startLo[first & 15] |= 1 << ((first >> 4) & 7);
+            matcher->startHi[first >> 4] |= 1 << ((first >> 4) & 7);
+        }
+    }
+    matcher->numClasses = numClasses;
+
+    // Trie first; a 0 entry past the root means "no edge yet"
+    size_t maxStates = totalLen + 1;
+    uint32_t *next = calloc(maxStates * numClasses, sizeof(uint32_t));
+    int32_t *match = malloc(maxStates * sizeof(int32_t));
+    uint32_t *fail = calloc(maxStates, sizeof(uint32_t));
+    match[0] = -1;
+    uint32_t numStates = 1;
+    for (int i = 0; i < numPatterns; i++) {
+        uint32_t state = 0;
+        for (size_t j = 0; j < matcher->lengths[i]; j++) {
+            uint32_t *edge = &next[state * numClasses + matcher->classes[(unsigned char) patterns[i][j]]];
+            if (*edge == 0) {
+                match[numStates] = -1;
+                *edge = numStates++;
+            }
+            state = *edge;
+        }
+        // The first of duplicate patterns is the one reported
+        if (state != 0 && match[state] == -1) {
+            match[state] = i;
+        }
+    }
+
+    // Breadth first, so a state's failure link is final before its children
+    // need it. Missing edges borrow the failure state's; a state with no
+    // pattern of its own reports the longest suffix that is one.
+    uint32_t *queue = malloc(numStates * sizeof(uint32_t));
+    size_t head = 0, tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        for (int c = 0; c < numClasses; c++) {
+            uint32_t *edge = &next[state * numClasses + c];
+            if (*edge != 0) {
+                uint32_t child = *edge;
+                fail[child] = state == 0 ? 0 : next[fail[state] * numClasses + c];
+                if (match[child] == -1) {
+                    match[child] = match[fail[child]];
+                }
+                queue[tail++] = child;
+            } else {
+                *edge = state == 0 ? 0 : next[fail[state] * numClasses + c];
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+
+    // Store row offsets rather than state numbers, with the match flag on top
+    for (size_t i = 0; i < (size_t) numStates * numClasses; i++) {
+        uint32_t target = next[i];
+        next[i] = target * numClasses | (match[target] >= 0 ? SEARCH_AC_MATCH : 0);
+    }
+    matcher->next = next;
+    matcher->match = match;
+    matcher->numStates = numStates;
+}
+
+void freeSearchMatcher(struct SearchMatcher *matcher) {
+    free(matcher->lengths);
+    free(matcher->next);
+    free(matcher->match);
+    memset(matcher, 0, sizeof(*matcher));
+}
+
+#ifdef SEARCH_SIMD
+// Nibble-table byte-set test, 16 bytes at a time: a byte passes when the
+// entries for its low and high nibble share a bit. Start bytes are bucketed
+// by high nibble, so the test is exact unless two buckets collide; a false
+// positive only costs one automaton step.
+__attribute__((target("ssse3")))
+const unsigned char *skipToStartByteSSSE3(const struct SearchMatcher *matcher, const unsigned char *p,
+                                          const unsigned char *stop) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *) matcher->startLo);
+    const __m128i hi = _mm_loadu_si128((const __m128i *) matcher->startHi);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    for (; p + 16 <= stop; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        __m128i hits = _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(block, nibble)),
+                                     _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(block, 4), nibble)));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128())) ^ 0xFFFF;
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (matcher->startBytes[p[bit]]) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return p;
+}
+#endif
+
+const unsigned char *skipToStartByte(const struct SearchMatcher *matcher, const unsigned char *p,
+                                     const unsigned char *stop) {
+#ifdef SEARCH_SIMD
+    static int haveSSSE3 = -1;
+    if (haveSSSE3 < 0) {
+        haveSSSE3 = __builtin_cpu_supports("ssse3");
+    }
+    if (haveSSSE3) {
+        p = skipToStartByteSSSE3(matcher, p, stop);
+    }
+#endif
+    while (p < stop && !matcher->startBytes[*p]) {
+        p++;
+    }
+    return p;
+}
+
+// Where the next hit at or after pos starts, and the pattern that made it
+const char *findSearchHit(const struct SearchMatcher *matcher, const char *pos, const char *end, int *pattern) {
+    *pattern = 0;
+    if (matcher->numPatterns < 2) {
+        size_t keywordLen = matcher->lengths[0];
+        return keywordLen > 0 ? findSubstring(pos, end - pos, matcher->patterns[0], keywordLen) : pos;
+    }
+
+    const unsigned char *p = (const unsigned char *) pos;
+    const unsigned char *stop = (const unsigned char *) end;
+    const uint32_t *next = matcher->next;
+    const uint16_t *classes = matcher->classes;
+    uint32_t state = 0;
+    while (p < stop) {
+        // At the root, skip straight to a byte that can start a pattern
+        if (state == 0) {
+            p = skipToStartByte(matcher, p, stop);
+            if (p == stop) {
+                break;
+            }
+        }
+        uint32_t entry = next[state + classes[*p]];
+        if (entry & SEARCH_AC_MATCH) {
+            *pattern = matcher->match[(entry & ~SEARCH_AC_MATCH) / matcher->numClasses];
+            return (const char *) p + 1 - matcher->lengths[*pattern];
+        }
+        state = entry;
+        p++;
+    }
+    return NULL;
+}
+
+void appendDecimal(struct OutputBuffer *out, unsigned long value) {
+    char digits[24];
+    char *pos = digits + sizeof(digits);
+    do {
+        *--pos = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    appendOutput(out, pos, digits + sizeof(digits) - pos);
+}
+
+// A JSON string literal; bytes from 0x80 up pass through as they are
+void appendJsonString(struct OutputBuffer *out, const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    appendOutput(out, "\"", 1);
+    const char *run = str;
+    for (const char *p = str; p < str + len; p++) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        appendOutput(out, run, p - run);
+        run = p + 1;
+        char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+        switch (c) {
+            case '"':
+            case '\\':
+                escape[1] = c;
+                appendOutput(out, escape, 2);
+                break;
+            case '\n':
+                appendOutput(out, "\\n", 2);
+                break;
+            case '\t':
+                appendOutput(out, "\\t", 2);
+                break;
+            case '\r':
+                appendOutput(out, "\\r", 2);
+                break;
+            default:
+                appendOutput(out, escape, 6);
+                break;
+        }
+    }
+    appendOutput(out, run, str + len - run);
+    appendOutput(out, "\"", 1);
+}
+
+// One matching line. JSON and NUL records hold the same fields in the same
+// order: path, line, column (1-based, bytes), offset of the match in the
+// file, pattern, and the line without its newline.
+void appendSearchHit(struct SearchTask *task, const struct SearchMatcher *matcher, int pattern, size_t lineNumber,
+                     const char *buf, const char *lineStart, const char *lineEnd, const char *match) {
+    struct OutputBuffer *out = &task->output;
+    const char *path = searchTaskPath(task);
+    const char *text = lineStart;
+    size_t textLen = lineEnd - lineStart;
+    if (task->format != SEARCH_FORMAT_TEXT && textLen > 0 && text[textLen - 1] == '\n') {
+        textLen--;
+    }
+
+    switch (task->format) {
+        case SEARCH_FORMAT_TEXT:
+            appendDecimal(out, lineNumber);
+            appendOutput(out, ":  '", 4);
+            appendOutput(out, path, strlen(path));
+            appendOutput(out, "' ", 2);
+            if (matcher->numPatterns > 1) {
+                appendOutput(out, "[", 1);
+                appendOutput(out, matcher->patterns[pattern], matcher->lengths[pattern]);
+                appendOutput(out, "] ", 2);
+            }
+            appendOutput(out, "-> ", 3);
+            appendOutput(out, text, textLen);
+            appendOutput(out, "\n", 1);
+            break;
+        case SEARCH_FORMAT_JSON:
+            appendOutput(out, "{\"path\":", 8);
+            appendJsonString(out, path, strlen(path));
+            appendOutput(out, ",\"line\":", 8);
+            appendDecimal(out, lineNumber);
+            appendOutput(out, ",\"column\":", 10);
+            appendDecimal(out, match - lineStart + 1);
+            appendOutput(out, ",\"offset\":", 10);
+            appendDecimal(out, match - buf);
+            appendOutput(out, ",\"pattern\":", 11);
+            appendJsonString(out, matcher->patterns[pattern], matcher->lengths[pattern]);
+            appendOutput(out, ",\"text\":", 8);
+            appendJsonString(out, text, textLen);
+            appendOutput(out, "}\n", 2);
+            break;
+        case SEARCH_FORMAT_NULL:
+            appendOutput(out, path, strlen(path) + 1);
+            appendDecimal(out, lineNumber);
+            appendOutput(out, "\0", 1);
+            appendDecimal(out, match - lineStart + 1);
+            appendOutput(out, "\0", 1);
+            appendDecimal(out, match - buf);
+            appendOutput(out, "\0", 1);
+            appendOutput(out, matcher->patterns[pattern], matcher->lengths[pattern] + 1);
+            appendOutput(out, text, textLen);
+            appendOutput(out, "\0", 1);
+            break;
+    }
+}
+
+// The per-file record of -c and -l: the path, plus the count for -c
+void appendSearchSummary(struct SearchTask *task) {
+    struct OutputBuffer *out = &task->output;
+    const char *path = searchTaskPath(task);
+    int withCount = task->mode == SEARCH_MODE_COUNT;
+
+    switch (task->format) {
+        case SEARCH_FORMAT_TEXT:
+            appendOutput(out, path, strlen(path));
+            if (withCount) {
+                appendOutput(out, ":", 1);
+                appendDecimal(out, task->count);
+            }
+            appendOutput(out, "\n", 1);
+            break;
+        case SEARCH_FORMAT_JSON:
+            appendOutput(out, "{\"path\":", 8);
+            appendJsonString(out, path, strlen(path));
+            if (withCount) {
+                appendOutput(out, ",\"count\":", 9);
+                appendDecimal(out, task->count);
+            }
+            appendOutput(out, "}\n", 2);
+            break;
+        case SEARCH_FORMAT_NULL:
+            appendOutput(out, path, strlen(path) + 1);
+            if (withCount) {
+                appendDecimal(out, task->count);
+                appendOutput(out, "\0", 1);
+            }
+            break;
+    }
+}
+
+// Report every line of buf that contains a pattern. Newlines are only counted
+// up to each hit, so a file with no match is never scanned for line breaks;
+// -c and -l skip line numbers and formatting altogether.
+void searchBuffer(const char *buf, size_t len, const struct SearchMatcher *matcher, struct SearchTask *task) {
+    const char *end = buf + len;
+    const char *pos = buf;            // Where the next search starts
+    const char *counted = buf;        // Newlines before this point are counted
+    size_t line_number = 1;
+    int pattern;
+
+    while (pos < end) {
+        const char *match = findSearchHit(matcher, pos, end, &pattern);
+        if (match == NULL) {
+            break;
+        }
+        task->count++;
+        if (task->mode == SEARCH_MODE_FILES) {
+            break;
+        }
+
+        const char *lineEnd = memchr(match, '\n', end - match);
+        lineEnd = lineEnd ? lineEnd + 1 : end;
+        if (task->mode == SEARCH_MODE_LINES) {
+            line_number += countNewlines(counted, match);
+            const char *lineStart = memrchr(buf, '\n', match - buf);
+            lineStart = lineStart ? lineStart + 1 : buf;
+            appendSearchHit(task, matcher, pattern, line_number, buf, lineStart, lineEnd, match);
+            line_number++;
+        }
+
+        // Resume on the next line; one report per line
+        pos = counted = lineEnd;
+    }
+
+    if (task->mode != SEARCH_MODE_LINES && task->count > 0) {
+        appendSearchSummary(task);
+    }
+}
+
+void searchInFile(struct SearchTask *task, const struct SearchMatcher *matcher) {
+    int fd = openat(task->dir != NULL ? task->dir->fd : AT_FDCWD, task->name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error opening file: %s\n", searchTaskPath(task));
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size >= SEARCH_MMAP_MIN) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            searchBuffer(map, st.st_size, matcher, task);
+            munmap(map, st.st_size);
+            close(fd);
+            return;
+        }
+    }
+
+    // Pipes, tiny files, or a failed map: read the whole thing into memory
+    size_t cap = S_ISREG(st.st_mode) && st.st_size > 0 ? (size_t) st.st_size + 1 : 65536;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, buf + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    searchBuffer(buf, len, matcher, task);
+    free(buf);
+    close(fd);
+}
+
+#ifdef SEARCH_URING
+// Completion tags live in the low bits of user_data, the slot index above them
+#define URING_OP_OPEN 0
+#define URING_OP_STATX 1
+#define URING_OP_READ 2
+#define URING_OP_CLOSE 3
+
+int openSearchRing(struct SearchRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    fcntl(ring->fd, F_SETFD, FD_CLOEXEC);
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->cqMapSize = ring->sqMapSize;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ring->cqMap = ring->cqMap == MAP_FAILED ? NULL : ring->cqMap;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        closeSearchRing(ring);
+        return -1;
+    }
+
+    char *sq = ring->sqMap;
+    char *cq = ring->cqMap;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+void closeSearchRing(struct SearchRing *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if (ring->sqMap != NULL) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Callers never queue more than the ring holds, so this cannot run out
+struct io_uring_sqe *queueSearchSqe(struct SearchRing *ring, int opcode, unsigned slot, int tag) {
+    unsigned tail = *ring->sqTail + ring->queued;
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = ((uint64_t) slot << 2) | tag;
+    ring->sqArray[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// Submit everything queued and wait for at least waitFor completions. The
+// count comes from the kernel's SQ head, so entries a failed call left
+// behind go in with the next one.
+int enterSearchRing(struct SearchRing *ring, unsigned waitFor) {
+    if (ring->queued > 0) {
+        __atomic_store_n(ring->sqTail, *ring->sqTail + ring->queued, __ATOMIC_RELEASE);
+        ring->inFlight += ring->queued;
+        ring->queued = 0;
+    }
+    while (1) {
+        unsigned toSubmit = *ring->sqTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        int ret = (int) syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitFor,
+                                waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || errno != EINTR) {
+            return ret;
+        }
+    }
+}
+
+// Ask the kernel to cancel everything in flight. Its completion carries the
+// close tag, so it is swallowed like one; an old kernel answers -EINVAL and
+// the operations simply run to completion instead.
+int cancelSearchRing(struct SearchRing *ring) {
+#ifdef IORING_ASYNC_CANCEL_ANY
+    if (*ring->sqTail + ring->queued - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = queueSearchSqe(ring, IORING_OP_ASYNC_CANCEL, 0, URING_OP_CLOSE);
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    return 0;
+#else
+    (void) ring;
+    return -1;
+#endif
+}
+
+// Submit the queued operations and keep reaping until every open, statx or
+// read among them has completed. Closes are fire-and-forget: their
+// completions are swallowed whenever they turn up.
+//
+// If io_uring_enter fails, the operations already handed over still point
+// into the slots, so they are cancelled and reaped until nothing is left in
+// flight. Should even that fail, the ring is closed, which makes the kernel
+// drop them. Returns -1 in both cases and the batch has to be redone.
+int runSearchRing(struct SearchRing *ring, struct SearchIoSlot *slots, unsigned expected) {
+    int failed = enterSearchRing(ring, 0) == -1;
+    int cancelled = 0;
+    while (failed ? ring->inFlight + ring->queued > 0 : expected > 0) {
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (failed && !cancelled) {
+                cancelled = 1;
+                cancelSearchRing(ring);
+            }
+            if (enterSearchRing(ring, 1) == -1) {
+                if (failed) {
+                    closeSearchRing(ring);
+                    return -1;
+                }
+                failed = 1;
+            }
+            continue;
+        }
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            struct SearchIoSlot *slot = &slots[cqe->user_data >> 2];
+            int res = cqe->res;
+            ring->inFlight--;
+            switch (cqe->user_data & 3) {
+                case URING_OP_OPEN:
+                    slot->fd = res;
+                    if (res < 0) {
+                        slot->error = -res;
+                    }
+                    expected--;
+                    break;
+                case URING_OP_STATX:
+                    if (res < 0 && slot->error == 0) {
+                        slot->error = -res;
+                    }
+                    expected--;
+                    break;
+                case URING_OP_READ:
+                    if (res < 0) {
+                        slot->error = -res;
+                    } else {
+                        slot->len = res;
+                    }
+                    expected--;
+                    break;
+                default:
+                    break;
+            }
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return failed ? -1 : 0;
+}
+
+// The ring failed partway through a batch: give back what it opened and
+// scan every file synchronously. Buffers are only freed while the ring is
+// still open, since a closed one may have left a read pending on them.
+void redoSearchBatch(struct SearchRing *ring, struct SearchIoSlot *slots, int count, const struct SearchMatcher *matcher) {
+    for (int i = 0; i < count; i++) {
+        if (slots[i].fd >= 0) {
+            close(slots[i].fd);
+        }
+        if (ring->fd != -1) {
+            free(slots[i].buf);
+        }
+        searchInFile(slots[i].task, matcher);
+    }
+}
+
+// Scan a batch of files with three round trips to the kernel: open and
+// statx them all, read the small ones, then queue the closes. Large files
+// are still mapped, and anything that is not a plain file goes through
+// searchInFile(), so the output is byte for byte what the sync path writes.
+void searchBatchUring(struct SearchRing *ring, struct SearchTask **tasks, int count, const struct SearchMatcher *matcher) {
+    // Not on the stack: a ring closed with operations in flight may still
+    // write to these, and its thread never batches again
+    static _Thread_local struct SearchIoSlot slots[SEARCH_URING_BATCH];
+
+    for (int i = 0; i < count; i++) {
+        struct SearchIoSlot *slot = &slots[i];
+        memset(slot, 0, sizeof(*slot));
+        slot->task = tasks[i];
+        slot->fd = -1;
+
+        int dirFd = slot->task->dir != NULL ? slot->task->dir->fd : AT_FDCWD;
+
+        struct io_uring_sqe *sqe = queueSearchSqe(ring, IORING_OP_OPENAT, i, URING_OP_OPEN);
+        sqe->fd = dirFd;
+        sqe->addr = (uintptr_t) slot->task->name;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        sqe = queueSearchSqe(ring, IORING_OP_STATX, i, URING_OP_STATX);
+        sqe->fd = dirFd;
+        sqe->addr = (uintptr_t) slot->task->name;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (uintptr_t) &slot->stx;
+    }
+    if (runSearchRing(ring, slots, 2 * count) == -1) {
+        redoSearchBatch(ring, slots, count, matcher);
+        return;
+    }
+
+    unsigned reads = 0;
+    for (int i = 0; i < count; i++) {
+        struct SearchIoSlot *slot = &slots[i];
+        if (slot->error != 0 || !S_ISREG(slot->stx.stx_mode) || slot->stx.stx_size == 0 ||
+            slot->stx.stx_size >= SEARCH_MMAP_MIN) {
+            continue;
+        }
+        slot->buf = malloc(slot->stx.stx_size + 1);
+        struct io_uring_sqe *sqe = queueSearchSqe(ring, IORING_OP_READ, i, URING_OP_READ);
+        sqe->fd = slot->fd;
+        sqe->addr = (uintptr_t) slot->buf;
+        sqe->len = slot->stx.stx_size;
+        sqe->off = 0;
+        reads++;
+    }
+    if (runSearchRing(ring, slots, reads) == -1) {
+        redoSearchBatch(ring, slots, count, matcher);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct SearchIoSlot *slot = &slots[i];
+        struct SearchTask *task = slot->task;
+        if (slot->fd < 0) {
+            fprintf(stderr, "Error opening file: %s\n", searchTaskPath(task));
+            continue;
+        }
+
+        // A file that grew after statx is scanned as it was then
+        int regular = slot->error == 0 && S_ISREG(slot->stx.stx_mode);
+        char *map;
+        if (regular && slot->buf != NULL) {
+            searchBuffer(slot->buf, slot->len, matcher, task);
+        } else if (regular && slot->stx.stx_size >= SEARCH_MMAP_MIN &&
+                   (map = mmap(NULL, slot->stx.stx_size, PROT_READ, MAP_PRIVATE, slot->fd, 0)) != MAP_FAILED) {
+            madvise(map, slot->stx.stx_size, MADV_SEQUENTIAL);
+            searchBuffer(map, slot->stx.stx_size, matcher, task);
+            munmap(map, slot->stx.stx_size);
+        } else if (!regular || slot->stx.stx_size > 0) {
+            // Failed read or map, pipe, device: leave it to the synchronous path
+            searchInFile(task, matcher);
+        }
+        free(slot->buf);
+
+        struct io_uring_sqe *sqe = queueSearchSqe(ring, IORING_OP_CLOSE, i, URING_OP_CLOSE);
+        sqe->fd = slot->fd;
+    }
+    enterSearchRing(ring, 0);
+}
+#endif
+
+// Probed once: the kernel may predate io_uring, lack an opcode we need, or
+// have it switched off (kernel.io_uring_disabled, seccomp filters).
+int searchUringSupported() {
+    static int supported = -1;
+#ifdef SEARCH_URING
+    if (supported == -1) {
+        struct SearchRing ring;
+        supported = 0;
+        if (openSearchRing(&ring, 4) == 0) {
+            size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+            struct io_uring_probe *probe = calloc(1, probeSize);
+            if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                probe->last_op >= IORING_OP_STATX) {
+                int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+                supported = 1;
+                for (int i = 0; i < 4; i++) {
+                    if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                        supported = 0;
+                    }
+                }
+            }
+            free(probe);
+            closeSearchRing(&ring);
+        }
+    }
+#else
+    supported = 0;
+#endif
+    return supported;
+}
+
+// Called by the walker for every file that passes the name filter
+void addFileList(struct FileList *list, const char *path) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 256;
+        list->paths = realloc(list->paths, list->cap * sizeof(char *));
+    }
+    list->paths[list->count++] = strdup(path);
+}
+
+void freeFileList(struct FileList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = list->cap = 0;
+}
+
+// Queue one file for scanning; dir is NULL when name is already a path
+void submitSearchFile(struct SearchEngine *engine, struct SearchDir *dir, const char *name) {
+    struct SearchTask *task = calloc(1, sizeof(struct SearchTask));
+    task->dir = dir;
+    task->name = strdup(name);
+    task->format = engine->options->format;
+    task->mode = engine->options->mode;
+    if (dir != NULL) {
+        atomic_fetch_add(&dir->refs, 1);
+    }
+    if (engine->collect != NULL) {
+        // The index stores paths, so here they are needed right away
+        addFileList(engine->collect, searchTaskPath(task));
+        freeSearchTask(task);
+        return;
+    }
+    if (dir != NULL) {
+        atomic_fetch_add(&dir->fdUsers, 1);
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->nextSeq - engine->nextEmit >= SEARCH_WINDOW) {
+        pthread_cond_wait(&engine->slotFree, &engine->lock);
+    }
+    task->seq = engine->nextSeq++;
+    engine->window[task->seq % SEARCH_WINDOW] = task;
+    struct SearchQueue *queue = &engine->queues[engine->nextQueue++ % engine->numWorkers];
+
+    pthread_mutex_lock(&queue->lock);
+    queue->items[(queue->head + queue->count) % SEARCH_WINDOW] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+
+    engine->queued++;
+    pthread_cond_signal(&engine->workReady);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+struct SearchTask *takeSearchTask(struct SearchQueue *queue, int steal) {
+    struct SearchTask *task = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count > 0) {
+        if (steal) {
+            task = queue->items[(queue->head + queue->count - 1) % SEARCH_WINDOW];
+        } else {
+            task = queue->items[queue->head];
+            queue->head = (queue->head + 1) % SEARCH_WINDOW;
+        }
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+struct SearchWorker {
+    struct SearchEngine *engine;
+    int index;
+};
+
+void *searchWorkerMain(void *arg) {
+    struct SearchWorker *worker = arg;
+    struct SearchEngine *engine = worker->engine;
+    struct SearchTask *batch[SEARCH_URING_BATCH];
+    int batchMax = 1;
+#ifdef SEARCH_URING
+    // A scanner whose ring cannot be set up just reads synchronously
+    struct SearchRing ring;
+    if (engine->options->ioMode == SEARCH_IO_URING && openSearchRing(&ring, 2 * SEARCH_URING_BATCH) == 0) {
+        batchMax = SEARCH_URING_BATCH;
+    }
+#endif
+
+    while (1) {
+        // Take what is ready, up to a batch; never wait for a batch to fill
+        int count = 0;
+        while (count < batchMax) {
+            struct SearchTask *task = takeSearchTask(&engine->queues[worker->index], 0);
+            for (int i = 1; task == NULL && i < engine->numWorkers; i++) {
+                task = takeSearchTask(&engine->queues[(worker->index + i) % engine->numWorkers], 1);
+            }
+            if (task == NULL) {
+                break;
+            }
+            batch[count++] = task;
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        if (count == 0) {
+            if (engine->queued == 0 && engine->walkDone) {
+                pthread_mutex_unlock(&engine->lock);
+                break;
+            }
+            if (engine->queued == 0) {
+                pthread_cond_wait(&engine->workReady, &engine->lock);
+            }
+            pthread_mutex_unlock(&engine->lock);
+            continue;
+        }
+        engine->queued -= count;
+        pthread_mutex_unlock(&engine->lock);
+
+#ifdef SEARCH_URING
+        if (batchMax > 1) {
+            searchBatchUring(&ring, batch, count, engine->matcher);
+            if (ring.fd == -1) {
+                batchMax = 1;
+            }
+        } else
+#endif
+        {
+            searchInFile(batch[0], engine->matcher);
+        }
+
+        // Directories can close as soon as their last queued file is read
+        for (int i = 0; i < count; i++) {
+            if (batch[i]->dir != NULL) {
+                releaseSearchDirFd(batch[i]->dir);
+            }
+        }
+
+        pthread_mutex_lock(&engine->lock);
+        for (int i = 0; i < count; i++) {
+            batch[i]->done = 1;
+            if (batch[i]->seq == engine->nextEmit) {
+                pthread_cond_signal(&engine->taskDone);
+            }
+        }
+        pthread_mutex_unlock(&engine->lock);
+    }
+
+#ifdef SEARCH_URING
+    if (batchMax > 1) {
+        closeSearchRing(&ring);
+    }
+#endif
+    return NULL;
+}
+
+void *searchWalkerMain(void *arg) {
+    struct SearchEngine *engine = arg;
+    if (engine->files != NULL) {
+        for (size_t i = 0; i < engine->files->count; i++) {
+            submitSearchFile(engine, NULL, engine->files->paths[i]);
+        }
+    } else {
+        walkSearchTree(engine, engine->root, engine->options->recursive);
+    }
+
+    pthread_mutex_lock(&engine->lock);
+    engine->walkDone = 1;
+    pthread_cond_broadcast(&engine->workReady);
+    pthread_cond_broadcast(&engine->taskDone);
+    pthread_mutex_unlock(&engine->lock);
+    return NULL;
+}
+
+void runSearch(char *path, struct SearchMatcher *matcher, struct SearchOptions *options, struct FileList *files) {
+    int numWorkers = options->numWorkers;
+    struct SearchEngine *engine = calloc(1, sizeof(struct SearchEngine));
+    engine->root = path;
+    engine->matcher = matcher;
+    engine->options = options;
+    engine->files = files;
+    engine->numWorkers = numWorkers;
+    pthread_mutex_init(&engine->lock, NULL);
+    pthread_cond_init(&engine->workReady, NULL);
+    pthread_cond_init(&engine->slotFree, NULL);
+    pthread_cond_init(&engine->taskDone, NULL);
+    pthread_cond_init(&engine->dirClosed, NULL);
+
+    engine->queues = calloc(numWorkers, sizeof(struct SearchQueue));
+    engine->workers = calloc(numWorkers, sizeof(pthread_t));
+    struct SearchWorker *workers = calloc(numWorkers, sizeof(struct SearchWorker));
+
+    // Every directory with files still queued holds an fd open. Leave room
+    // for the shell's own fds and what each scanner has open at once.
+    struct rlimit savedLimit, limit;
+    getrlimit(RLIMIT_NOFILE, &savedLimit);
+    limit = savedLimit;
+    if (limit.rlim_cur < SEARCH_WINDOW * 2) {
+        limit.rlim_cur = limit.rlim_max < SEARCH_WINDOW * 2 ? limit.rlim_max : SEARCH_WINDOW * 2;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    rlim_t budget = limit.rlim_cur < SEARCH_WINDOW * 4 ? limit.rlim_cur : SEARCH_WINDOW * 4;
+    engine->maxOpenDirs = (int) budget - 64 - numWorkers * (SEARCH_URING_BATCH + 2);
+    if (engine->maxOpenDirs < 16) {
+        engine->maxOpenDirs = 16;
+    }
+
+    // Signals are the shell's business, not the search threads'
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+
+    for (int i = 0; i < numWorkers; i++) {
+        engine->queues[i].items = calloc(SEARCH_WINDOW, sizeof(struct SearchTask *));
+        pthread_mutex_init(&engine->queues[i].lock, NULL);
+        workers[i].engine = engine;
+        workers[i].index = i;
+    }
+    // Files are only queued to the scanners that started; with none, or
+    // no walker, nothing is searched
+    int started = 0, err = 0;
+    while (started < numWorkers &&
+           (err = pthread_create(&engine->workers[started], NULL, searchWorkerMain, &workers[started])) == 0) {
+        started++;
+    }
+    engine->numWorkers = started;
+    int walking = started > 0 && (err = pthread_create(&engine->walker, NULL, searchWalkerMain, engine)) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (err != 0) {
+        fprintf(stderr, "search: cannot start threads: %s%s\n", strerror(err),
+                walking ? "; using fewer" : "");
+    }
+    if (!walking) {
+        pthread_mutex_lock(&engine->lock);
+        engine->walkDone = 1;
+        pthread_cond_broadcast(&engine->workReady);
+        pthread_mutex_unlock(&engine->lock);
+    }
+
+    // Write results in walk order as soon as each file's turn comes up. They
+    // are gathered into one large buffer that goes out with write() when it
+    // fills, or whenever the next file is not ready yet.
+    fflush(stdout);
+    struct OutputBuffer pending = {malloc(SEARCH_OUTPUT_BUFFER), 0, SEARCH_OUTPUT_BUFFER};
+    pthread_mutex_lock(&engine->lock);
+    while (1) {
+        struct SearchTask *task = engine->window[engine->nextEmit % SEARCH_WINDOW];
+        if (engine->nextEmit < engine->nextSeq && task != NULL && task->done) {
+            engine->window[engine->nextEmit % SEARCH_WINDOW] = NULL;
+            engine->nextEmit++;
+            pthread_cond_signal(&engine->slotFree);
+            pthread_mutex_unlock(&engine->lock);
+
+            if (pending.len + task->output.len > pending.cap) {
+                writeOutput(STDOUT_FILENO, pending.data, pending.len);
+                pending.len = 0;
+            }
+            if (task->output.len >= pending.cap) {
+                writeOutput(STDOUT_FILENO, task->output.data, task->output.len);
+            } else {
+                appendOutput(&pending, task->output.data, task->output.len);
+            }
+            freeSearchTask(task);
+
+            pthread_mutex_lock(&engine->lock);
+            continue;
+        }
+        if (engine->walkDone && engine->nextEmit == engine->nextSeq) {
+            break;
+        }
+        if (pending.len > 0) {
+            pthread_mutex_unlock(&engine->lock);
+            writeOutput(STDOUT_FILENO, pending.data, pending.len);
+            pending.len = 0;
+            pthread_mutex_lock(&engine->lock);
+            continue;
+        }
+        pthread_cond_wait(&engine->taskDone, &engine->lock);
+    }
+    pthread_mutex_unlock(&engine->lock);
+    writeOutput(STDOUT_FILENO, pending.data, pending.len);
+    free(pending.data);
+
+    if (walking) {
+        pthread_join(engine->walker, NULL);
+    }
+    for (int i = 0; i < numWorkers; i++) {
+        if (i < started) {
+            pthread_join(engine->workers[i], NULL);
+        }
+        free(engine->queues[i].items);
+        pthread_mutex_destroy(&engine->queues[i].lock);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    pthread_cond_destroy(&engine->workReady);
+    pthread_cond_destroy(&engine->slotFree);
+    pthread_cond_destroy(&engine->taskDone);
+    pthread_cond_destroy(&engine->dirClosed);
+    free(workers);
+    free(engine->workers);
+    free(engine->queues);
+    free(engine);
+    setrlimit(RLIMIT_NOFILE, &savedLimit);
+}
+
+// Lines of a -f file, one pattern each; blank lines are skipped
+int readSearchPatterns(const char *filename, char ***patterns, int *numPatterns, int *cap) {
+    FILE *file = fopen(filename, "re");
+    if (file == NULL) {
+        perror("Error opening pattern file");
+        return -1;
+    }
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &lineCap, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (*numPatterns == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *patterns = realloc(*patterns, *cap * sizeof(char *));
+        }
+        (*patterns)[(*numPatterns)++] = arenaStrdup(&commandArena, line);
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+void handleSearchCommand(char *args[]) {
+    struct SearchOptions options;
+    memset(&options, 0, sizeof(options));
+    options.numWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    options.ioMode = SEARCH_IO_SYNC;
+    options.filter.useIgnoreFiles = 1;
+    struct SearchFilter *filter = &options.filter;
+    int indexed = 0;
+    char **patterns = NULL;
+    int numPatterns = 0;
+    int cap = 0;
+    int failed = 0;
+
+    for (int i = 1; args[i] != NULL && !failed; i++) {
+        char *pattern = NULL;
+        if (strcmp(args[i], "-r") == 0) {
+            options.recursive = 1;
+        } else if (strcmp(args[i], "--index") == 0) {
+            indexed = 1;
+        } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            options.numWorkers = atoi(args[++i]);
+        } else if (strcmp(args[i], "--io=uring") == 0) {
+            options.ioMode = SEARCH_IO_URING;
+        } else if (strcmp(args[i], "--io=sync") == 0) {
+            options.ioMode = SEARCH_IO_SYNC;
+        } else if (strcmp(args[i], "-t") == 0 && args[i + 1] != NULL) {
+            char *types = trimQuotes(args[++i]);
+            for (char *ext = types; *ext != '\0' && !failed;) {
+                size_t len = strcspn(ext, ",");
+                if (len > 0 && addSearchExtension(filter, ext, len) == -1) {
+                    printf("search: bad file type: %.*s\n", (int) len, ext);
+                    failed = 1;
+                }
+                ext += len + (ext[len] == ',');
+            }
+        } else if (strcmp(args[i], "--include") == 0 && args[i + 1] != NULL) {
+            filter->includes = realloc(filter->includes, (filter->numIncludes + 1) * sizeof(char *));
+            filter->includes[filter->numIncludes++] = trimQuotes(args[++i]);
+        } else if (strcmp(args[i], "--exclude") == 0 && args[i + 1] != NULL) {
+            filter->excludes = realloc(filter->excludes, (filter->numExcludes + 1) * sizeof(char *));
+            filter->excludes[filter->numExcludes++] = trimQuotes(args[++i]);
+        } else if (strcmp(args[i], "--no-ignore") == 0) {
+            filter->useIgnoreFiles = 0;
+        } else if (strcmp(args[i], "--json") == 0) {
+            options.format = SEARCH_FORMAT_JSON;
+        } else if (strcmp(args[i], "--null") == 0) {
+            options.format = SEARCH_FORMAT_NULL;
+        } else if (strcmp(args[i], "-c") == 0) {
+            options.mode = SEARCH_MODE_COUNT;
+        } else if (strcmp(args[i], "-l") == 0) {
+            options.mode = SEARCH_MODE_FILES;
+        } else if (strcmp(args[i], "-e") == 0 && args[i + 1] != NULL) {
+            pattern = args[++i];
+        } else if (strcmp(args[i], "-f") == 0 && args[i + 1] != NULL) {
+            failed = readSearchPatterns(args[++i], &patterns, &numPatterns, &cap) == -1;
+        } else if (args[i][0] == '-') {
+            // A misspelt option must not turn into a keyword; "-e -x" searches for -x
+            const char *valued[] = {"-j", "-t", "--include", "--exclude", "-e", "-f", NULL};
+            int needsValue = 0;
+            for (int v = 0; valued[v] != NULL; v++) {
+                needsValue |= strcmp(args[i], valued[v]) == 0;
+            }
+            if (needsValue) {
+                printf("search: %s needs an argument\n", args[i]);
+            } else {
+                printf("search: unknown option: %s (use -e for a pattern starting with '-')\n", args[i]);
+            }
+            failed = 1;
+        } else {
+            pattern = args[i];
+        }
+
+        if (pattern != NULL) {
+            if (numPatterns == cap) {
+                cap = cap ? cap * 2 : 16;
+                patterns = realloc(patterns, cap * sizeof(char *));
+            }
+            patterns[numPatterns++] = trimQuotes(pattern);
+        }
+    }
+
+    // An empty pattern matches every line; among others it would drown them out
+    if (numPatterns > 1) {
+        int kept = 0;
+        for (int i = 0; i < numPatterns; i++) {
+            if (patterns[i][0] != '\0') {
+                patterns[kept++] = patterns[i];
+            }
+        }
+        numPatterns = kept;
+    }
+
+    if (numPatterns == 0 && !failed) {
+        printf("Usage: search [-r] [-j N] [--index] [--io=uring|sync] [-t ext,...] [--include glob] "
+               "[--exclude glob] [--no-ignore] [-c|-l] [--json|--null] [-e pattern]... [-f file] [keyword]\n");
+    }
+    if (numPatterns == 0 || failed) {
+        free(patterns);
+        free(filter->includes);
+        free(filter->excludes);
+        lastStatus = 2;  // As grep: the search never ran
+        return;
+    }
+
+    // C sources and headers unless told otherwise
+    if (filter->numExtensions == 0 && filter->numIncludes == 0) {
+        addSearchExtension(filter, "c", 1);
+        addSearchExtension(filter, "h", 1);
+    }
+    // More scanners than a few per CPU only add threads and open files
+    long maxWorkers = 4 * sysconf(_SC_NPROCESSORS_ONLN);
+    if (options.numWorkers > maxWorkers) {
+        options.numWorkers = maxWorkers > 0 ? (int) maxWorkers : 1;
+    }
+    if (options.numWorkers < 1) {
+        options.numWorkers = 1;
+    }
+    if (options.ioMode == SEARCH_IO_URING && !searchUringSupported()) {
+        if (interactive) {
+            fprintf(stderr, "search: io_uring is not available, using synchronous I/O\n");
+        }
+        options.ioMode = SEARCH_IO_SYNC;
+    }
+
+    struct SearchMatcher matcher;
+    compileSearchMatcher(patterns, numPatterns, &matcher);
+    if (indexed) {
+        runIndexedSearch(".", &matcher, &options);
+    } else {
+        runSearch(".", &matcher, &options, NULL);
+    }
+    lastStatus = 0;
+    freeSearchMatcher(&matcher);
+    free(patterns);
+    free(filter->includes);
+    free(filter->excludes);
+}
+
+int compareStrings(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+int compareUint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+void closeSearchIndex(struct SearchIndex *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+// Map an index file and check that its tables fit inside it
+int openSearchIndex(const char *filename, struct SearchIndex *index) {
+    memset(index, 0, sizeof(*index));
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct SearchIndexHeader)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    index->map = map;
+    index->size = st.st_size;
+    index->header = (struct SearchIndexHeader *) map;
+
+    // Postings lie between postingsOffset and pathsOffset, paths from there to the end
+    struct SearchIndexHeader *header = index->header;
+    if (memcmp(header->magic, SEARCH_INDEX_MAGIC, sizeof(SEARCH_INDEX_MAGIC)) != 0 || header->size != index->size ||
+        header->filesOffset % 8 != 0 || header->trigramsOffset % 8 != 0 || header->postingsOffset % 4 != 0 ||
+        header->filesOffset > header->size || header->trigramsOffset > header->size ||
+        header->filesOffset + (uint64_t) header->numFiles * sizeof(struct SearchIndexFile) > header->size ||
+        header->trigramsOffset + (uint64_t) header->numTrigrams * sizeof(struct SearchIndexTrigram) > header->size ||
+        header->postingsOffset > header->pathsOffset || header->pathsOffset > header->size ||
+        (header->numFiles > 0 && (header->pathsOffset == header->size || map[header->size - 1] != '\0'))) {
+        closeSearchIndex(index);
+        return -1;
+    }
+    index->files = (struct SearchIndexFile *) (map + header->filesOffset);
+    index->paths = map + header->pathsOffset;
+    index->trigrams = (struct SearchIndexTrigram *) (map + header->trigramsOffset);
+    index->postings = (uint32_t *) (map + header->postingsOffset);
+
+    // With the paths region ending in a NUL, every path in it is terminated
+    uint64_t numPostings = (header->pathsOffset - header->postingsOffset) / sizeof(uint32_t);
+    for (uint32_t i = 0; i < header->numTrigrams; i++) {
+        const struct SearchIndexTrigram *entry = &index->trigrams[i];
+        if (entry->offset > numPostings || entry->count > numPostings - entry->offset) {
+            closeSearchIndex(index);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < header->numFiles; i++) {
+        if (index->files[i].pathOffset >= header->size - header->pathsOffset) {
+            closeSearchIndex(index);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Append one (trigram << 32 | fileId) pair per distinct trigram in the file
+void indexFileTrigrams(const char *path, uint32_t fileId, uint64_t **pairs, size_t *numPairs, size_t *cap, uint8_t *seen) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < 3) {
+        close(fd);
+        return;
+    }
+    const unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t first = *numPairs;
+    uint32_t trigram = (data[0] << 8) | data[1];
+    for (off_t i = 2; i < st.st_size; i++) {
+        trigram = ((trigram << 8) | data[i]) & 0xFFFFFF;
+        if (seen[trigram >> 3] & (1 << (trigram & 7))) {
+            continue;
+        }
+        seen[trigram >> 3] |= 1 << (trigram & 7);
+        if (*numPairs == *cap) {
+            *cap = *cap ? *cap * 2 : 1 << 16;
+            *pairs = realloc(*pairs, *cap * sizeof(uint64_t));
+        }
+        (*pairs)[(*numPairs)++] = ((uint64_t) trigram << 32) | fileId;
+    }
+    munmap((void *) data, st.st_size);
+
+    // Clear only the bits this file set
+    for (size_t i = first; i < *numPairs; i++) {
+        uint32_t t = (uint32_t) ((*pairs)[i] >> 32);
+        seen[t >> 3] = 0;
+    }
+}
+
+// Rebuild the index for the given (sorted) file list. Files whose size and
+// mtime match the old index keep their posting entries without being read;
+// only new or changed files are opened. Returns 0 when the index is current.
+int refreshSearchIndex(const char *filename, struct FileList *files, struct SearchIndex *old) {
+    size_t numFiles = files->count;
+    struct SearchIndexFile *entries = calloc(numFiles ? numFiles : 1, sizeof(struct SearchIndexFile));
+    int32_t *oldToNew = NULL;
+    size_t pathsSize = 0;
+    size_t changed = 0;
+
+    if (old->map != NULL) {
+        oldToNew = malloc((old->header->numFiles ? old->header->numFiles : 1) * sizeof(int32_t));
+        for (uint32_t i = 0; i < old->header->numFiles; i++) {
+            oldToNew[i] = -1;
+        }
+    }
+
+    // Old and new file lists are both sorted, so match them with a merge
+    uint32_t o = 0;
+    uint8_t *reindex = calloc(numFiles ? numFiles : 1, 1);
+    for (size_t i = 0; i < numFiles; i++) {
+        struct stat st;
+        if (stat(files->paths[i], &st) == 0) {
+            entries[i].size = st.st_size;
+            entries[i].mtimeSec = st.st_mtim.tv_sec;
+            entries[i].mtimeNsec = st.st_mtim.tv_nsec;
+        }
+        entries[i].pathOffset = pathsSize;
+        pathsSize += strlen(files->paths[i]) + 1;
+
+        int cmp = 1;
+        while (old->map != NULL && o < old->header->numFiles &&
+               (cmp = strcmp(old->paths + old->files[o].pathOffset, files->paths[i])) < 0) {
+            o++;
+        }
+        if (cmp == 0 && old->files[o].size == entries[i].size && old->files[o].mtimeSec == entries[i].mtimeSec &&
+            old->files[o].mtimeNsec == entries[i].mtimeNsec) {
+            oldToNew[o] = (int32_t) i;
+        } else {
+            reindex[i] = 1;
+            changed++;
+        }
+    }
+
+    if (old->map != NULL && changed == 0 && old->header->numFiles == numFiles) {
+        free(entries);
+        free(oldToNew);
+        free(reindex);
+        return 0;
+    }
+
+    // Trigrams of new and changed files, sorted by trigram then file id
+    uint64_t *pairs = NULL;
+    size_t numPairs = 0, pairsCap = 0;
+    uint8_t *seen = calloc(1 << 21, 1);
+    for (size_t i = 0; i < numFiles; i++) {
+        if (reindex[i]) {
+            indexFileTrigrams(files->paths[i], (uint32_t) i, &pairs, &numPairs, &pairsCap, seen);
+        }
+    }
+    free(seen);
+    qsort(pairs, numPairs, sizeof(uint64_t), compareUint64);
+
+    // Merge the surviving old postings with the new pairs, trigram by trigram
+    struct SearchIndexTrigram *trigrams = NULL;
+    size_t numTrigrams = 0, trigramsCap = 0;
+    uint32_t *postings = NULL;
+    size_t numPostings = 0, postingsCap = 0;
+    uint32_t oldTrigram = 0;
+    size_t p = 0;
+    uint32_t numOld = old->map != NULL ? old->header->numTrigrams : 0;
+
+    while (oldTrigram < numOld || p < numPairs) {
+        uint32_t trigram;
+        if (p < numPairs && (oldTrigram >= numOld || (uint32_t) (pairs[p] >> 32) <= old->trigrams[oldTrigram].trigram)) {
+            trigram = (uint32_t) (pairs[p] >> 32);
+        } else {
+            trigram = old->trigrams[oldTrigram].trigram;
+        }
+
+        const uint32_t *oldList = NULL;
+        uint32_t oldCount = 0;
+        if (oldTrigram < numOld && old->trigrams[oldTrigram].trigram == trigram) {
+            oldList = old->postings + old->trigrams[oldTrigram].offset;
+            oldCount = old->trigrams[oldTrigram].count;
+            oldTrigram++;
+        }
+
+        size_t start = numPostings;
+        uint32_t k = 0;
+        while (k < oldCount || (p < numPairs && (uint32_t) (pairs[p] >> 32) == trigram)) {
+            int64_t fromOld = -1;
+            while (k < oldCount && (fromOld = oldToNew[oldList[k]]) < 0) {
+                k++;
+            }
+            if (k >= oldCount) {
+                fromOld = -1;
+            }
+            int64_t fromNew = p < numPairs && (uint32_t) (pairs[p] >> 32) == trigram ? (int64_t) (uint32_t) pairs[p] : -1;
+            if (fromOld < 0 && fromNew < 0) {
+                break;
+            }
+
+            uint32_t id;
+            if (fromNew < 0 || (fromOld >= 0 && fromOld < fromNew)) {
+                id = (uint32_t) fromOld;
+                k++;
+            } else {
+                id = (uint32_t) fromNew;
+                p++;
+            }
+            if (numPostings == postingsCap) {
+                postingsCap = postingsCap ? postingsCap * 2 : 1 << 16;
+                postings = realloc(postings, postingsCap * sizeof(uint32_t));
+            }
+            postings[numPostings++] = id;
+        }
+
+        if (numPostings > start) {
+            if (numTrigrams == trigramsCap) {
+                trigramsCap = trigramsCap ? trigramsCap * 2 : 1 << 12;
+                trigrams = realloc(trigrams, trigramsCap * sizeof(struct SearchIndexTrigram));
+            }
+            trigrams[numTrigrams].trigram = trigram;
+            trigrams[numTrigrams].count = (uint32_t) (numPostings - start);
+            trigrams[numTrigrams].offset = start;
+            numTrigrams++;
+        }
+    }
+    free(pairs);
+    free(oldToNew);
+    free(reindex);
+
+    struct SearchIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_INDEX_MAGIC, sizeof(SEARCH_INDEX_MAGIC));
+    header.numFiles = (uint32_t) numFiles;
+    header.numTrigrams = (uint32_t) numTrigrams;
+    header.filesOffset = sizeof(header);
+    header.trigramsOffset = header.filesOffset + numFiles * sizeof(struct SearchIndexFile);
+    header.postingsOffset = header.trigramsOffset + numTrigrams * sizeof(struct SearchIndexTrigram);
+    header.pathsOffset = header.postingsOffset + numPostings * sizeof(uint32_t);
+    header.size = header.pathsOffset + pathsSize;
+
+    // Write next to the old index and rename over it so readers never see a partial file
+    char tmpName[MAX_PATH];
+    snprintf(tmpName, sizeof(tmpName), "%s.%d", filename, (int) getpid());
+    FILE *out = fopen(tmpName, "we");
+    int result = -1;
+    if (out != NULL) {
+        fwrite(&header, sizeof(header), 1, out);
+        fwrite(entries, sizeof(struct SearchIndexFile), numFiles, out);
+        fwrite(trigrams, sizeof(struct SearchIndexTrigram), numTrigrams, out);
+        fwrite(postings, sizeof(uint32_t), numPostings, out);
+        for (size_t i = 0; i < numFiles; i++) {
+            fwrite(files->paths[i], 1, strlen(files->paths[i]) + 1, out);
+        }
+        if (fclose(out) == 0 && rename(tmpName, filename) == 0) {
+            result = 1;
+        } else {
+            perror("search --index");
+            unlink(tmpName);
+        }
+    } else {
+        perror("search --index");
+    }
+
+    free(entries);
+    free(trigrams);
+    free(postings);
+    return result;
+}
+
+const struct SearchIndexTrigram *findIndexTrigram(struct SearchIndex *index, uint32_t trigram) {
+    uint32_t lo = 0, hi = index->header->numTrigrams;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->trigrams[mid].trigram < trigram) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < index->header->numTrigrams && index->trigrams[lo].trigram == trigram) {
+        return &index->trigrams[lo];
+    }
+    return NULL;
+}
+
+// Files that contain every trigram of at least one pattern, in index (path)
+// order. A pattern shorter than three bytes cannot be filtered: every file
+// qualifies.
+void querySearchIndex(struct SearchIndex *index, const struct SearchMatcher *matcher, struct FileList *candidates) {
+    uint32_t numFiles = index->header->numFiles;
+    uint32_t *ids = malloc((numFiles ? numFiles : 1) * sizeof(uint32_t));
+    uint8_t *hit = calloc(numFiles ? numFiles : 1, 1);
+
+    for (int p = 0; p < matcher->numPatterns; p++) {
+        const char *keyword = matcher->patterns[p];
+        size_t keywordLen = matcher->lengths[p];
+        uint32_t numIds = numFiles;
+        for (uint32_t i = 0; i < numFiles; i++) {
+            ids[i] = i;
+        }
+
+        for (size_t i = 0; i + 3 <= keywordLen && numIds > 0; i++) {
+            const unsigned char *k = (const unsigned char *) keyword + i;
+            const struct SearchIndexTrigram *entry = findIndexTrigram(index, (k[0] << 16) | (k[1] << 8) | k[2]);
+            if (entry == NULL) {
+                numIds = 0;
+                break;
+            }
+            const uint32_t *list = index->postings + entry->offset;
+            uint32_t kept = 0, j = 0;
+            for (uint32_t n = 0; n < numIds && j < entry->count;) {
+                if (ids[n] < list[j]) {
+                    n++;
+                } else if (ids[n] > list[j]) {
+                    j++;
+                } else {
+                    ids[kept++] = ids[n];
+                    n++;
+                    j++;
+                }
+            }
+            numIds = kept;
+        }
+
+        for (uint32_t i = 0; i < numIds; i++) {
+            hit[ids[i]] = 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < numFiles; i++) {
+        if (hit[i]) {
+            addFileList(candidates, index->paths + index->files[i].pathOffset);
+        }
+    }
+    free(hit);
+    free(ids);
+}
+
+// Indexed search: refresh the trigram index for the tree under path, then
+// verify only the candidate files with the normal matcher. The index always
+// covers the recursive file set; without -r, candidates outside path itself
+// are dropped.
+void runIndexedSearch(char *path, struct SearchMatcher *matcher, struct SearchOptions *options) {
+    struct FileList files = {0};
+    struct SearchEngine walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.collect = &files;
+    walk.options = options;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.dirClosed, NULL);
+    walkSearchTree(&walk, path, 1);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.dirClosed);
+
+    // Symlinks can lead to a file by more than one path; the index wants a sorted set
+    qsort(files.paths, files.count, sizeof(char *), compareStrings);
+    size_t unique = 0;
+    for (size_t i = 0; i < files.count; i++) {
+        if (unique > 0 && strcmp(files.paths[unique - 1], files.paths[i]) == 0) {
+            free(files.paths[i]);
+        } else {
+            files.paths[unique++] = files.paths[i];
+        }
+    }
+    files.count = unique;
+
+    char filename[MAX_PATH];
+    snprintf(filename, sizeof(filename), "%s/%s", path, SEARCH_INDEX_FILE);
+
+    struct SearchIndex index;
+    openSearchIndex(filename, &index);
+    int refreshed = refreshSearchIndex(filename, &files, &index);
+    freeFileList(&files);
+    if (refreshed > 0) {
+        closeSearchIndex(&index);
+        if (openSearchIndex(filename, &index) == -1) {
+            fprintf(stderr, "search --index: cannot read %s\n", filename);
+            return;
+        }
+    } else if (refreshed < 0 || index.map == NULL) {
+        closeSearchIndex(&index);
+        return;
+    }
+
+    struct FileList candidates = {0};
+    querySearchIndex(&index, matcher, &candidates);
+    closeSearchIndex(&index);
+
+    if (!options->recursive) {
+        size_t kept = 0;
+        size_t prefixLen = strlen(path);
+        for (size_t i = 0; i < candidates.count; i++) {
+            if (strchr(candidates.paths[i] + prefixLen + 1, '/') == NULL) {
+                candidates.paths[kept++] = candidates.paths[i];
+            } else {
+                free(candidates.paths[i]);
+            }
+        }
+        candidates.count = kept;
+    }
+
+    runSearch(path, matcher, options, &candidates);
+    freeFileList(&candidates);
+}
+
+// Lowercased extension packed into an integer; 0 when it cannot be one
+uint64_t packExtension(const char *ext, size_t len) {
+    if (len == 0 || len > 8) {
+        return 0;
+    }
+    uint64_t key = 0;
+    for (size_t i = 0; i < len; i++) {
+        key |= (uint64_t) tolower((unsigned char) ext[i]) << (8 * i);
+    }
+    return key;
+}
+
+size_t extensionSlot(uint64_t key) {
+    return (key * 0x9E3779B97F4A7C15ull) >> 57;  // Top 7 bits: SEARCH_EXT_SLOTS
+}
+
+int addSearchExtension(struct SearchFilter *filter, const char *ext, size_t len) {
+    uint64_t key = packExtension(ext, len);
+    if (key == 0 || filter->numExtensions >= SEARCH_EXT_SLOTS / 2) {
+        return -1;
+    }
+    size_t slot = extensionSlot(key);
+    while (filter->extensions[slot] != 0 && filter->extensions[slot] != key) {
+        slot = (slot + 1) % SEARCH_EXT_SLOTS;
+    }
+    if (filter->extensions[slot] == 0) {
+        filter->extensions[slot] = key;
+        filter->numExtensions++;
+    }
+    return 0;
+}
+
+// Only the real suffix counts: "x.c" matches c, "x.c.orig" and "x.cache" do not
+int hasSearchExtension(const struct SearchFilter *filter, const char *name) {
+    const char *dot = strrchr(name, '.');
+    if (dot == NULL || dot == name) {
+        return 0;
+    }
+    uint64_t key = packExtension(dot + 1, strlen(dot + 1));
+    if (key == 0) {
+        return 0;
+    }
+    for (size_t slot = extensionSlot(key); filter->extensions[slot] != 0; slot = (slot + 1) % SEARCH_EXT_SLOTS) {
+        if (filter->extensions[slot] == key) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int matchesAnyGlob(char **globs, int numGlobs, const char *name) {
+    for (int i = 0; i < numGlobs; i++) {
+        if (fnmatch(globs[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The file name half of the filter; ignore files are checked by the walker
+int isSearchFile(const struct SearchFilter *filter, const char *name) {
+    if (filter->numExtensions > 0 && !hasSearchExtension(filter, name)) {
+        return 0;
+    }
+    if (filter->numIncludes > 0 && !matchesAnyGlob(filter->includes, filter->numIncludes, name)) {
+        return 0;
+    }
+    return !matchesAnyGlob(filter->excludes, filter->numExcludes, name);
+}
+
+// Append the rules in one ignore file. Supports comments, "!" negation,
+// trailing "/" for directories, a "/" anywhere else to anchor the pattern
+// to this directory, and "**/" prefixes; the rest is left to fnmatch.
+void loadSearchIgnore(struct SearchDir *dir, const char *filename) {
+    int fd = openat(dir->fd, filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    char *text = malloc(st.st_size + 1);
+    ssize_t len = read(fd, text, st.st_size);
+    close(fd);
+    if (len <= 0) {
+        free(text);
+        return;
+    }
+    text[len] = '\0';
+
+    if (dir->ignore == NULL) {
+        dir->ignore = calloc(1, sizeof(struct SearchIgnore));
+    }
+    struct SearchIgnore *ignore = dir->ignore;
+
+    char *save = NULL;
+    for (char *line = strtok_r(text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        size_t n = strlen(line);
+        while (n > 0 && (line[n - 1] == '\r' || line[n - 1] == ' ' || line[n - 1] == '\t')) {
+            line[--n] = '\0';
+        }
+        if (n == 0 || line[0] == '#') {
+            continue;
+        }
+
+        struct SearchIgnoreRule rule = {0};
+        if (line[0] == '!') {
+            rule.negate = 1;
+            line++;
+        } else if (line[0] == '\\') {
+            line++;
+        }
+        n = strlen(line);
+        if (n > 0 && line[n - 1] == '/') {
+            rule.dirOnly = 1;
+            line[--n] = '\0';
+        }
+        if (strncmp(line, "**/", 3) == 0) {
+            rule.anyDepth = 1;
+            line += 3;
+        } else if (strchr(line, '/') != NULL) {
+            rule.anchored = 1;
+            if (line[0] == '/') {
+                line++;
+            }
+        }
+        // "dir/**" is everything below dir, which pruning dir covers
+        n = strlen(line);
+        if (n >= 3 && strcmp(line + n - 3, "/**") == 0) {
+            line[n - 3] = '\0';
+            rule.dirOnly = 1;
+        }
+        if (line[0] == '\0') {
+            continue;
+        }
+        rule.pattern = strdup(line);
+
+        ignore->rules = realloc(ignore->rules, (ignore->numRules + 1) * sizeof(struct SearchIgnoreRule));
+        ignore->rules[ignore->numRules++] = rule;
+    }
+    free(text);
+}
+
+void freeSearchIgnore(struct SearchIgnore *ignore) {
+    if (ignore != NULL) {
+        for (int i = 0; i < ignore->numRules; i++) {
+            free(ignore->rules[i].pattern);
+        }
+        free(ignore->rules);
+        free(ignore);
+    }
+}
+
+// Path of name relative to the directory ancestor; NULL if it does not fit
+const char *relativeSearchPath(struct SearchDir *ancestor, struct SearchDir *dir, const char *name, char *buf,
+                               size_t size) {
+    size_t len = strlen(name);
+    for (struct SearchDir *d = dir; d != ancestor; d = d->parent) {
+        len += strlen(d->name) + 1;
+    }
+    if (len + 1 > size) {
+        return NULL;
+    }
+    char *pos = buf + len;
+    *pos = '\0';
+    size_t n = strlen(name);
+    pos -= n;
+    memcpy(pos, name, n);
+    for (struct SearchDir *d = dir; d != ancestor; d = d->parent) {
+        *--pos = '/';
+        n = strlen(d->name);
+        pos -= n;
+        memcpy(pos, d->name, n);
+    }
+    return buf;
+}
+
+int matchesIgnoreRule(const struct SearchIgnoreRule *rule, const char *name, const char *relative) {
+    if (rule->anyDepth) {
+        // Try the whole relative path and each part after a '/'
+        for (const char *part = relative; part != NULL; part = strchr(part, '/')) {
+            part += *part == '/';
+            if (fnmatch(rule->pattern, part, FNM_PATHNAME) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if (rule->anchored) {
+        // "**" in the middle: let '*' cross directory boundaries
+        int flags = strstr(rule->pattern, "**") != NULL ? 0 : FNM_PATHNAME;
+        return relative != NULL && fnmatch(rule->pattern, relative, flags) == 0;
+    }
+    return fnmatch(rule->pattern, name, 0) == 0;
+}
+
+// Git's precedence: the deepest ignore file decides, and within a file the
+// last matching line wins
+int isSearchIgnored(struct SearchDir *dir, const char *name, int isDir) {
+    char buf[PATH_MAX];
+    for (struct SearchDir *d = dir; d != NULL; d = d->parent) {
+        if (d->ignore == NULL) {
+            continue;
+        }
+        const char *relative = NULL;
+        int haveRelative = 0;
+        for (int i = d->ignore->numRules - 1; i >= 0; i--) {
+            const struct SearchIgnoreRule *rule = &d->ignore->rules[i];
+            if (rule->dirOnly && !isDir) {
+                continue;
+            }
+            if ((rule->anchored || rule->anyDepth) && !haveRelative) {
+                relative = relativeSearchPath(d, dir, name, buf, sizeof(buf));
+                haveRelative = 1;
+            }
+            if (rule->anyDepth && relative == NULL) {
+                continue;
+            }
+            if (matchesIgnoreRule(rule, name, relative)) {
+                return !rule->negate;
+            }
+        }
+    }
+    return 0;
+}
+
+// "root/dir/.../name", assembled back to front from the directory chain
+const char *searchTaskPath(struct SearchTask *task) {
+    if (task->path != NULL) {
+        return task->path;
+    }
+    size_t len = strlen(task->name);
+    for (struct SearchDir *dir = task->dir; dir != NULL; dir = dir->parent) {
+        len += strlen(dir->name) + 1;
+    }
+    char *path = malloc(len + 1);
+    char *pos = path + len;
+    *pos = '\0';
+    size_t nameLen = strlen(task->name);
+    pos -= nameLen;
+    memcpy(pos, task->name, nameLen);
+    for (struct SearchDir *dir = task->dir; dir != NULL; dir = dir->parent) {
+        *--pos = '/';
+        nameLen = strlen(dir->name);
+        pos -= nameLen;
+        memcpy(pos, dir->name, nameLen);
+    }
+    task->path = path;
+    return path;
+}
+
+// Called once per walker or queued file when it is done with dir->fd
+void releaseSearchDirFd(struct SearchDir *dir) {
+    if (atomic_fetch_sub(&dir->fdUsers, 1) == 1) {
+        close(dir->fd);
+        dir->fd = -1;
+        struct SearchEngine *engine = dir->engine;
+        pthread_mutex_lock(&engine->lock);
+        engine->openDirs--;
+        pthread_cond_signal(&engine->dirClosed);
+        pthread_mutex_unlock(&engine->lock);
+    }
+}
+
+void releaseSearchDir(struct SearchDir *dir) {
+    while (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        struct SearchDir *parent = dir->parent;
+        freeSearchIgnore(dir->ignore);
+        free(dir->name);
+        free(dir);
+        dir = parent;
+    }
+}
+
+void freeSearchTask(struct SearchTask *task) {
+    releaseSearchDir(task->dir);
+    free(task->output.data);
+    free(task->name);
+    free(task->path);
+    free(task);
+}
+
+// Open name under parent. Directories already on the way down from the
+// root are refused: only a symlink can lead back to one, and following it
+// would never end.
+//
+// Queued files keep their directory open, so with many small directories
+// the walker could run out of fds. Past maxOpenDirs it waits for scanners
+// to finish with some, as long as any are held by files and not just by
+// the walker's own descent.
+struct SearchDir *openSearchDir(struct SearchEngine *engine, struct SearchDir *parent, const char *name) {
+    pthread_mutex_lock(&engine->lock);
+    while (engine->openDirs >= engine->maxOpenDirs && engine->openDirs > engine->walkDepth) {
+        pthread_cond_wait(&engine->dirClosed, &engine->lock);
+    }
+    engine->openDirs++;
+    pthread_mutex_unlock(&engine->lock);
+
+    int fd = openat(parent != NULL ? parent->fd : AT_FDCWD, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    int loop = 0;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror("Error opening directory");
+        loop = -1;
+    }
+    for (struct SearchDir *up = parent; loop == 0 && up != NULL; up = up->parent) {
+        loop = up->dev == st.st_dev && up->ino == st.st_ino;
+    }
+    if (loop != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        pthread_mutex_lock(&engine->lock);
+        engine->openDirs--;
+        pthread_mutex_unlock(&engine->lock);
+        return NULL;
+    }
+
+    struct SearchDir *dir = calloc(1, sizeof(struct SearchDir));
+    dir->engine = engine;
+    dir->parent = parent;
+    if (parent != NULL) {
+        atomic_fetch_add(&parent->refs, 1);
+    }
+    dir->name = strdup(name);
+    dir->fd = fd;
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    atomic_init(&dir->refs, 1);
+    atomic_init(&dir->fdUsers, 1);
+    return dir;
+}
+
+// Depth-first, in directory order. Symlinks are followed to files and
+// directories alike; fstatat is only needed for them and on filesystems
+// that leave d_type unset. The whole listing is read before any entry is
+// looked at, so the directory's own ignore files apply to all of them.
+void walkSearchDir(struct SearchEngine *engine, struct SearchDir *dir, int recursive) {
+    struct SearchFilter *filter = &engine->options->filter;
+    pthread_mutex_lock(&engine->lock);
+    engine->walkDepth++;
+    pthread_mutex_unlock(&engine->lock);
+
+    size_t cap = SEARCH_DENTS_BUFFER, len = 0;
+    char *buf = malloc(cap);
+    ssize_t n;
+    while ((n = getdents64(dir->fd, buf + len, cap - len)) > 0) {
+        len += n;
+        if (cap - len < SEARCH_DENTS_BUFFER / 2) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+
+    if (filter->useIgnoreFiles) {
+        int haveGitignore = 0, haveIgnore = 0;
+        for (size_t offset = 0; offset < len;) {
+            struct dirent64 *ent = (struct dirent64 *) (buf + offset);
+            offset += ent->d_reclen;
+            haveGitignore |= strcmp(ent->d_name, ".gitignore") == 0;
+            haveIgnore |= strcmp(ent->d_name, ".ignore") == 0;
+        }
+        // .ignore is read last so its lines take precedence
+        if (haveGitignore) {
+            loadSearchIgnore(dir, ".gitignore");
+        }
+        if (haveIgnore) {
+            loadSearchIgnore(dir, ".ignore");
+        }
+    }
+
+    for (size_t offset = 0; offset < len;) {
+        struct dirent64 *ent = (struct dirent64 *) (buf + offset);
+        offset += ent->d_reclen;
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat st;
+            if (fstatat(dir->fd, name, &st, 0) == -1) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_REG) {
+            if (isSearchFile(filter, name) && !(filter->useIgnoreFiles && isSearchIgnored(dir, name, 0))) {
+                submitSearchFile(engine, dir, name);
+            }
+        } else if (type == DT_DIR && recursive) {
+            // Version control metadata is never worth scanning
+            if (strcmp(name, ".git") == 0 || matchesAnyGlob(filter->excludes, filter->numExcludes, name) ||
+                (filter->useIgnoreFiles && isSearchIgnored(dir, name, 1))) {
+                continue;
+            }
+            struct SearchDir *child = openSearchDir(engine, dir, name);
+            if (child != NULL) {
+                walkSearchDir(engine, child, recursive);
+                releaseSearchDirFd(child);
+                releaseSearchDir(child);
+            }
+        }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&engine->lock);
+    engine->walkDepth--;
+    pthread_mutex_unlock(&engine->lock);
+}
+
+void walkSearchTree(struct SearchEngine *engine, const char *root, int recursive) {
+    struct SearchDir *dir = openSearchDir(engine, NULL, root);
+    if (dir != NULL) {
+        walkSearchDir(engine, dir, recursive);
+        releaseSearchDirFd(dir);
+        releaseSearchDir(dir);
+    }
+}
+
+// Run one parsed command line: a pipeline, a builtin or an external command
+void runCommand(char *args[], int background) {
+    struct IORedirection redirection;
+
+    if (strcmp(args[0], "time") == 0) {
+        // A prefix, so it has to see the whole line, pipes included
+        handleTimeCommand(args);
+    } else if (isPipeline(args)) {
+        runPipeline(args, background);
+    } else {
+        // Builtins only set the status when they have one to report
+        lastStatus = 0;
+        // Check for I/O redirection; builtins get it too
+        handleIOredirection(args, &redirection);
+        if (!handleInternalCommands(args, &redirection)) {
+            // If it's not an internal command, execute the command
+            executeCommand(args, background, &redirection);
+        }
+    }
+}
+
+void initTrie(struct Trie *trie) {
+    trie->cap = 1024;
+    trie->count = 1;  // The root
+    trie->nodes = calloc(trie->cap, sizeof(struct TrieNode));
+}
+
+void freeTrie(struct Trie *trie) {
+    free(trie->nodes);
+    trie->nodes = NULL;
+    trie->count = trie->cap = 0;
+}
+
+// The child of node for byte, or 0 if it has none
+uint32_t findTrieChild(struct Trie *trie, uint32_t node, unsigned char byte) {
+    uint32_t child = trie->nodes[node].child;
+    while (child != 0 && trie->nodes[child].byte < byte) {
+        child = trie->nodes[child].sibling;
+    }
+    return child != 0 && trie->nodes[child].byte == byte ? child : 0;
+}
+
+// The node for prefix, or -1 if no word starts with it
+int64_t findTrieNode(struct Trie *trie, const char *prefix) {
+    uint32_t node = 0;
+    for (const char *p = prefix; *p != '\0'; p++) {
+        node = findTrieChild(trie, node, (unsigned char) *p);
+        if (node == 0) {
+            return -1;
+        }
+    }
+    return node;
+}
+
+void insertTrieWord(struct Trie *trie, const char *word) {
+    int64_t existing = findTrieNode(trie, word);
+    if (existing >= 0 && trie->nodes[existing].terminal) {
+        return;  // The same name in two $PATH directories
+    }
+    uint32_t node = 0;
+    trie->nodes[0].words++;
+    for (const char *p = word; *p != '\0'; p++) {
+        unsigned char byte = (unsigned char) *p;
+        uint32_t child = findTrieChild(trie, node, byte);
+        if (child == 0) {
+            if (trie->count == trie->cap) {
+                trie->cap *= 2;
+                trie->nodes = realloc(trie->nodes, trie->cap * sizeof(struct TrieNode));
+            }
+            // Link it in among its siblings in byte order
+            child = trie->count++;
+            uint32_t *link = &trie->nodes[node].child;
+            while (*link != 0 && trie->nodes[*link].byte < byte) {
+                link = &trie->nodes[*link].sibling;
+            }
+            trie->nodes[child] = (struct TrieNode) {0, *link, 0, byte, 0};
+            *link = child;
+        }
+        node = child;
+        trie->nodes[node].words++;
+    }
+    trie->nodes[node].terminal = 1;
+}
+
+// Append to out the bytes that every word below node shares
+size_t extendTrieNode(struct Trie *trie, uint32_t node, char *out, size_t max) {
+    size_t n = 0;
+    while (n + 1 < max && !trie->nodes[node].terminal) {
+        uint32_t child = trie->nodes[node].child;
+        if (child == 0 || trie->nodes[child].sibling != 0) {
+            break;
+        }
+        out[n++] = (char) trie->nodes[child].byte;
+        node = child;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// Depth first, so the words come out sorted
+void collectTrieWords(struct Trie *trie, uint32_t node, char *word, size_t len, struct Completions *found) {
+    if (trie->nodes[node].terminal && found->count < EDITOR_LIST_MAX) {
+        word[len] = '\0';
+        found->words[found->count++] = arenaStrdup(&commandArena, word);
+    }
+    for (uint32_t child = trie->nodes[node].child; child != 0 && found->count < EDITOR_LIST_MAX;
+         child = trie->nodes[child].sibling) {
+        if (len + 1 < PATH_MAX) {
+            word[len] = (char) trie->nodes[child].byte;
+            collectTrieWords(trie, child, word, len + 1, found);
+        }
+    }
+}
+
+// Every completion of word in the trie: how many, their common prefix and
+// the first EDITOR_LIST_MAX of them
+void completeFromTrie(struct Trie *trie, const char *word, struct Completions *found) {
+    int64_t node = findTrieNode(trie, word);
+    if (node < 0) {
+        return;
+    }
+    char *text = arenaAlloc(&commandArena, PATH_MAX);
+    size_t len = strlen(word);
+    memcpy(text, word, len);
+    len += extendTrieNode(trie, node, text + len, PATH_MAX - len);
+    found->total = trie->nodes[node].words;
+    found->common = arenaStrdup(&commandArena, text);
+    collectTrieWords(trie, node, text, strlen(word), found);
+}
+
+// Rebuild the command trie if $PATH, or the contents of one of its
+// directories, changed since it was built. The directory mtimes come
+// from the command cache's own periodic check.
+void syncCommandCompletions(struct CommandCompletions *completions) {
+    syncCommandCache();
+    int stale = completions->pathValue == NULL || strcmp(completions->pathValue, commandCache.pathValue) != 0 ||
+                completions->numDirs != commandCache.numDirs;
+    for (int i = 0; !stale && i < commandCache.numDirs; i++) {
+        stale = completions->mtimes[i].tv_sec != commandCache.dirs[i].mtime.tv_sec ||
+                completions->mtimes[i].tv_nsec != commandCache.dirs[i].mtime.tv_nsec;
+    }
+    if (!stale) {
+        return;
+    }
+
+    freeTrie(&completions->trie);
+    initTrie(&completions->trie);
+    free(completions->pathValue);
+    free(completions->mtimes);
+    completions->pathValue = strdup(commandCache.pathValue);
+    completions->numDirs = commandCache.numDirs;
+    completions->mtimes = calloc(commandCache.numDirs + 1, sizeof(struct timespec));
+
+    insertTrieWord(&completions->trie, "time");
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        insertTrieWord(&completions->trie, builtins[i].name);
+    }
+    for (int i = 0; i < commandCache.numDirs; i++) {
+        struct PathDir *pathDir = &commandCache.dirs[i];
+        completions->mtimes[i] = pathDir->mtime;
+        DIR *dir = pathDir->exists ? opendir(pathDir->dir) : NULL;
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.' && entry->d_type != DT_DIR &&
+                faccessat(dirfd(dir), entry->d_name, X_OK, 0) == 0) {
+                insertTrieWord(&completions->trie, entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+void freeDirListing(struct DirListing *listing) {
+    for (int i = 0; i < listing->count; i++) {
+        free(listing->names[i]);
+    }
+    free(listing->names);
+    free(listing->dir);
+    memset(listing, 0, sizeof(*listing));
+}
+
+// The sorted names in dir, directories marked with a trailing '/'. A
+// listing is kept until the directory's mtime moves; the least recently
+// used one makes room for a new directory.
+struct DirListing *readDirListing(struct LineEditor *editor, const char *dir) {
+    struct stat st;
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    editor->tick++;
+    struct DirListing *slot = &editor->dirs[0];
+    for (int i = 0; i < EDITOR_DIR_CACHE; i++) {
+        struct DirListing *listing = &editor->dirs[i];
+        if (listing->dir != NULL && strcmp(listing->dir, dir) == 0) {
+            if (listing->dev == st.st_dev && listing->ino == st.st_ino &&
+                listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                listing->used = editor->tick;
+                return listing;
+            }
+            slot = listing;  // Changed since it was read
+            break;
+        }
+        if (listing->used < slot->used) {
+            slot = listing;
+        }
+    }
 
-    if ((length < 0) && (errno != EINTR)) {
-        perror("error reading the command");
-        exit(-1);
+    freeDirListing(slot);
+    DIR *handle = opendir(dir);
+    if (handle == NULL) {
+        return NULL;
+    }
+    int cap = 64;
+    slot->names = malloc(cap * sizeof(char *));
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int isDir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat target;
+            isDir = fstatat(dirfd(handle), entry->d_name, &target, 0) == 0 && S_ISDIR(target.st_mode);
+        }
+        if (slot->count == cap) {
+            cap *= 2;
+            slot->names = realloc(slot->names, cap * sizeof(char *));
+        }
+        size_t len = strlen(entry->d_name);
+        char *name = malloc(len + 2);
+        memcpy(name, entry->d_name, len);
+        strcpy(name + len, isDir ? "/" : "");
+        slot->names[slot->count++] = name;
+    }
+    closedir(handle);
+    qsort(slot->names, slot->count, sizeof(char *), compareStrings);
+    slot->dir = strdup(dir);
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    slot->used = editor->tick;
+    return slot;
+}
+
+// Names in word's directory that start with its last component. Hidden
+// files only come up when that component starts with a dot.
+void completeFilename(struct LineEditor *editor, const char *word, struct Completions *found) {
+    const char *slash = strrchr(word, '/');
+    const char *base = slash != NULL ? slash + 1 : word;
+    size_t dirLen = base - word;
+    char dir[PATH_MAX];
+    const char *home = getenv("HOME");
+    if (dirLen == 0) {
+        strcpy(dir, ".");
+    } else if (strncmp(word, "~/", 2) == 0 && home != NULL) {
+        snprintf(dir, sizeof(dir), "%s%.*s", home, (int) dirLen - 1, word + 1);
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int) dirLen, word);
+    }
+    struct DirListing *listing = readDirListing(editor, dir);
+    if (listing == NULL) {
+        return;
+    }
+
+    // Binary search for the first name not below base
+    size_t baseLen = strlen(base);
+    int low = 0, high = listing->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strcmp(listing->names[mid], base) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    const char *first = NULL, *last = NULL;
+    for (int i = low; i < listing->count && strncmp(listing->names[i], base, baseLen) == 0; i++) {
+        const char *name = listing->names[i];
+        if (name[0] == '.' && base[0] != '.') {
+            continue;
+        }
+        if (found->count < EDITOR_LIST_MAX) {
+            found->words[found->count++] = (char *) name;
+        }
+        if (first == NULL) {
+            first = name;
+        }
+        last = name;
+        found->total++;
+    }
+    if (first == NULL) {
+        return;
     }
+    // Sorted, so what the first and last share, all of them share
+    size_t common = 0;
+    while (first[common] != '\0' && first[common] == last[common]) {
+        common++;
+    }
+    char *text = arenaAlloc(&commandArena, dirLen + common + 1);
+    memcpy(text, word, dirLen);
+    memcpy(text + dirLen, first, common);
+    text[dirLen + common] = '\0';
+    found->common = text;
+}
 
-    for (i = 0; i < length; i++) {
-        switch (inputBuffer[i]) {
-            case ' ':
-            case '\t':
-                if (start != -1) {
-                    args[ct] = &inputBuffer[start];
-                    ct++;
-                }
-                inputBuffer[i] = '\0';
-                start = -1;
-                break;
-            case '\n':
-                if (start != -1) {
-                    args[ct] = &inputBuffer[start];
-                    ct++;
-                }
-                inputBuffer[i] = '\0';
-                args[ct] = NULL;
-                break;
-            default:
-                if (start == -1)
-                    start = i;
-                if (inputBuffer[i] == '&') {
-                    // Remove the ampersand from the command name if it exists
-                    if (i > 0) {
-                        inputBuffer[i - 1] = '\0';
-                    }
-                    *background = 1;
-                }
-        }
+void editorWrite(struct LineEditor *editor, const char *data, size_t len) {
+    if (editor->outLen + len > editor->outCap) {
+        editor->outCap = (editor->outLen + len) * 2;
+        editor->out = realloc(editor->out, editor->outCap);
     }
-    args[ct] = NULL;
+    memcpy(editor->out + editor->outLen, data, len);
+    editor->outLen += len;
 }
 
+void editorPuts(struct LineEditor *editor, const char *text) {
+    editorWrite(editor, text, strlen(text));
+}
 
-void executeCommand(char *args[], int background) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child process
-        // Remove the ampersand from the command name if it exists
-        size_t len = strlen(args[0]);
-        if (len > 0 && args[0][len - 1] == '&') {
-            args[0][len - 1] = '\0';
-        }
+// One write per keystroke
+void flushEditor(struct LineEditor *editor) {
+    writeOutput(STDOUT_FILENO, editor->out, editor->outLen);
+    editor->outLen = 0;
+}
 
-	setpgid(0, 0);
-	
-	if (background) {
-            int devNull = open("/dev/null", O_WRONLY);
-            dup2(devNull, STDOUT_FILENO);
-            close(devNull);
+int isUtf8Continuation(char byte) {
+    return ((unsigned char) byte & 0xC0) == 0x80;
+}
+
+// Terminal columns taken by text[from..to): two for wide characters, none
+// for combining ones. Bytes that do not decode take one each.
+size_t editorColumns(const char *text, size_t from, size_t to) {
+    size_t columns = 0;
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    for (size_t i = from; i < to;) {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, text + i, to - i, &state);
+        if (n == 0 || n == (size_t) -1 || n == (size_t) -2) {
+            memset(&state, 0, sizeof(state));
+            columns++;
+            while (++i < to && isUtf8Continuation(text[i])) {
+            }
+            continue;
         }
+        int width = wcwidth(wc);
+        columns += width >= 0 ? (size_t) width : 1;
+        i += n;
+    }
+    return columns;
+}
 
-        // Use execv to search each directory in the PATH for the command
-        char *path = getenv("PATH");
-        char *token = strtok(path, ":");
+// Columns from the start of the prompt to byte at of what is on screen
+size_t editorScreenColumn(struct LineEditor *editor, size_t at) {
+    return editor->promptColumns + editorColumns(editor->shown, 0, at);
+}
 
-        while (token != NULL) {
-            char commandPath[MAX_PATH];
-            snprintf(commandPath, sizeof(commandPath), "%s/%s", token, args[0]);
+volatile sig_atomic_t editorResized = 0;
 
-            // Check if the file exists at the specified path
-            struct stat st;
-            if (stat(commandPath, &st) == 0) {
-                printf("Executing: %s\n", commandPath);  // Print the command being executed
-                execv(commandPath, args);
-            }
+void handleSIGWINCH(int sig) {
+    (void) sig;
+    editorResized = 1;
+}
 
-            token = strtok(NULL, ":");
-        }
+void updateEditorWidth(struct LineEditor *editor) {
+    struct winsize size;
+    editor->width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 ? size.ws_col : 80;
+}
 
-        // If the loop completes, the command was not found
-        fprintf(stderr, "Command not found: %s\n", args[0]);
-        exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        // Parent process
-        if (!background) {
-            // Wait for the foreground process to complete
-            int status;
-            foregroundProcess = pid;
-            waitpid(pid, &status, 0);
-            foregroundProcess = 0;
-            if (WIFEXITED(status)) {
-                printf("Foreground process exited with status %d\n", WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)) {
-                printf("Foreground process terminated by signal %d\n", WTERMSIG(status));
-            }
+// Move the terminal cursor from byte from to byte to of what is on
+// screen. Within a row: backspaces or one CSI sequence going left, and
+// the characters already there going right. Between the rows of a
+// wrapped line: up or down, then across from the left edge.
+void moveEditorCursor(struct LineEditor *editor, size_t from, size_t to) {
+    if (from == to) {
+        return;
+    }
+    size_t fromColumn = editorScreenColumn(editor, from);
+    size_t toColumn = editorScreenColumn(editor, to);
+    size_t fromRow = fromColumn / editor->width, toRow = toColumn / editor->width;
+    char move[48];
+    if (fromRow != toRow) {
+        snprintf(move, sizeof(move), "\x1b[%zu%c\r", fromRow > toRow ? fromRow - toRow : toRow - fromRow,
+                 fromRow > toRow ? 'A' : 'B');
+        editorPuts(editor, move);
+        if (toColumn % editor->width > 0) {
+            snprintf(move, sizeof(move), "\x1b[%zuC", toColumn % editor->width);
+            editorPuts(editor, move);
+        }
+    } else if (to < from) {
+        size_t columns = fromColumn - toColumn;
+        if (columns == 1) {
+            editorPuts(editor, "\b");
         } else {
-            // In background mode, do not wait for the process to complete
-            printf("Background process started: %d\n", pid);
+            snprintf(move, sizeof(move), "\x1b[%zuD", columns);
+            editorPuts(editor, move);
         }
     } else {
-        perror("fork");
-        exit(EXIT_FAILURE);
+        editorWrite(editor, editor->shown + from, to - from);
     }
 }
 
+// Bring the screen up to date with the buffer by rewriting only what
+// follows the first difference, then put the cursor in place
+void refreshEditorLine(struct LineEditor *editor) {
+    size_t common = 0;
+    while (common < editor->len && common < editor->shownLen && editor->buf[common] == editor->shown[common]) {
+        common++;
+    }
+    while (common > 0 && ((common < editor->len && isUtf8Continuation(editor->buf[common])) ||
+                          (common < editor->shownLen && isUtf8Continuation(editor->shown[common])))) {
+        common--;
+    }
 
+    size_t position = editor->shownCursor;
+    if (common < editor->len || common < editor->shownLen) {
+        moveEditorCursor(editor, position, common);
+        editorWrite(editor, editor->buf + common, editor->len - common);
+        size_t oldEnd = editorScreenColumn(editor, editor->shownLen);
+        if (editor->len > editor->shownCap) {
+            editor->shownCap = editor->cap;
+            editor->shown = realloc(editor->shown, editor->shownCap);
+        }
+        memcpy(editor->shown, editor->buf, editor->len);
+        editor->shownLen = editor->len;
+        position = editor->len;
+        size_t newEnd = editorScreenColumn(editor, editor->len);
+        if (newEnd > 0 && newEnd % editor->width == 0) {
+            // The terminal holds the cursor on the full row until the
+            // next character; take it to the next row now
+            editorPuts(editor, "\n");
+        }
+        if (oldEnd > newEnd) {
+            editorPuts(editor, "\x1b[J");
+        }
+    }
+    moveEditorCursor(editor, position, editor->cursor);
+    editor->shownCursor = editor->cursor;
+}
 
-int handleInternalCommands(char *args[]) {
+// Put the cursor on a fresh row below the line, to print under it
+void leaveEditorLine(struct LineEditor *editor) {
+    moveEditorCursor(editor, editor->shownCursor, editor->shownLen);
+    editor->shownCursor = editor->shownLen;
+    size_t end = editorScreenColumn(editor, editor->shownLen);
+    if (end == 0 || end % editor->width != 0) {
+        editorPuts(editor, "\n");
+    }
+}
 
-    char *path = ".";
+// Back to the first row of text just written, columns wide, from its end
+void returnToEditorRow(struct LineEditor *editor, size_t columns) {
+    if (columns > editor->width) {
+        char move[32];
+        snprintf(move, sizeof(move), "\x1b[%zuA", (columns - 1) / editor->width);
+        editorPuts(editor, move);
+    }
+    editorPuts(editor, "\r");
+}
 
-    if (strcmp(args[0], "^Z") == 0) {
-        // Stop the currently running foreground process
-        if (foregroundProcess != 0) {
-            kill(foregroundProcess, SIGSTOP);
-            printf("Foreground process stopped: %d\n", foregroundProcess);
-        } else {
-            printf("No foreground process to stop.\n");
-        }
-        return 1; // Internal command handled
-    } else if (strcmp(args[0], "search") == 0) {
-        if (args[1] != NULL) {
-            if (strcmp(args[1], "-r") == 0) {
-                if (args[2] != NULL) {
-                    searchFiles(".", trimQuotes(args[2]), 1);
-                }
-            }
-            else {
-                searchFiles(".", trimQuotes(args[1]), 0);
-            }
-        } else {
-            printf("Usage: search <keyword>\n");
-        }
-        return 1; // Internal command handled
-    } else if (strcmp(args[0], "bookmark") == 0) {
-        handleBookmarkCommand(args);
-        return 1; // Internal command handled
-    } else if (strcmp(args[0], "exit") == 0) {
-        // Terminate the shell process
-        if (foregroundProcess == 0) {
-            exit(0);
-        } else {
-            printf("Cannot exit while there are background processes running.\n");
-        }
-        return 1; // Internal command handled
+// Start the line over on screen, after anything printed below it
+void redrawEditorLine(struct LineEditor *editor) {
+    editorPuts(editor, "\r");
+    editorPuts(editor, editor->prompt);
+    editorPuts(editor, "\x1b[J");
+    editor->shownLen = editor->shownCursor = 0;
+    refreshEditorLine(editor);
+}
+
+void reserveEditorLine(struct LineEditor *editor, size_t len) {
+    if (len + 1 > editor->cap) {
+        editor->cap = (len + 1) * 2;
+        editor->buf = realloc(editor->buf, editor->cap);
     }
-    return 0; // Not an internal command
 }
 
+void insertEditorText(struct LineEditor *editor, const char *text, size_t len) {
+    reserveEditorLine(editor, editor->len + len);
+    memmove(editor->buf + editor->cursor + len, editor->buf + editor->cursor, editor->len - editor->cursor);
+    memcpy(editor->buf + editor->cursor, text, len);
+    editor->len += len;
+    editor->cursor += len;
+}
 
-void handleIOredirection(char *args[]) {
-    int i;
-    int inputRedirect = 0;
-    int outputRedirect = 0;
-    int errorRedirect = 0;
-    char *inputFile = NULL;
-    char *outputFile = NULL;
-    char *errorFile = NULL;
+void deleteEditorText(struct LineEditor *editor, size_t from, size_t to) {
+    memmove(editor->buf + from, editor->buf + to, editor->len - to);
+    editor->len -= to - from;
+    if (editor->cursor >= to) {
+        editor->cursor -= to - from;
+    } else if (editor->cursor > from) {
+        editor->cursor = from;
+    }
+}
 
-    for (i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "<") == 0) {
-            // Input redirection
-            inputRedirect = 1;
-            args[i] = NULL;
-            inputFile = args[i + 1];
-        } else if (strcmp(args[i], ">") == 0) {
-            // Output redirection
-            outputRedirect = 1;
-            args[i] = NULL;
-            outputFile = args[i + 1];
-        } else if (strcmp(args[i], ">>") == 0) {
-            // Append output redirection
-            outputRedirect = 1;
-            args[i] = NULL;
-            outputFile = args[i + 1];
-        } else if (strcmp(args[i], "2>") == 0) {
-            // Error redirection
-            errorRedirect = 1;
-            args[i] = NULL;
-            errorFile = args[i + 1];
+void setEditorLine(struct LineEditor *editor, const char *text, size_t len) {
+    reserveEditorLine(editor, len);
+    memcpy(editor->buf, text, len);
+    editor->len = editor->cursor = len;
+}
+
+// Next byte from the terminal, or -1 at end of input or after waitMs
+// without one (when waitMs is not -1)
+int readEditorByte(int waitMs) {
+    unsigned char byte;
+    if (waitMs >= 0) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, waitMs) <= 0) {
+            return -1;
         }
     }
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &byte, 1)) == -1 && errno == EINTR) {
+    }
+    return n == 1 ? byte : -1;
+}
 
-    if (inputRedirect) {
-        int fd = open(inputFile, O_RDONLY);
-        if (fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
+// A byte, or one of the EDITOR_KEY_ codes for an escape sequence; 0 for
+// sequences the editor does not use, -1 at end of input
+int readEditorKey(struct LineEditor *editor) {
+    if (editor->pendingKey != 0) {
+        int key = editor->pendingKey;
+        editor->pendingKey = 0;
+        return key;
+    }
+    int byte = readEditorByte(-1);
+    if (byte != 27) {
+        return byte;
+    }
+    // A lone Escape is not followed by anything straight away
+    int kind = readEditorByte(50);
+    if (kind != '[' && kind != 'O') {
+        return 27;
+    }
+    int code = readEditorByte(50);
+    if (code >= '0' && code <= '9') {
+        int final = readEditorByte(50);
+        if (final == '~') {
+            switch (code) {
+                case '1': case '7': return EDITOR_KEY_HOME;
+                case '4': case '8': return EDITOR_KEY_END;
+                case '3': return EDITOR_KEY_DELETE;
+            }
         }
-        dup2(fd, STDIN_FILENO);
-        close(fd);
+        // Modified keys such as ESC[1;5C: skip to the final byte
+        while (final != -1 && (final < 0x40 || final > 0x7E)) {
+            final = readEditorByte(50);
+        }
+        return 0;
     }
+    switch (code) {
+        case 'A': return EDITOR_KEY_UP;
+        case 'B': return EDITOR_KEY_DOWN;
+        case 'C': return EDITOR_KEY_RIGHT;
+        case 'D': return EDITOR_KEY_LEFT;
+        case 'H': return EDITOR_KEY_HOME;
+        case 'F': return EDITOR_KEY_END;
+    }
+    return 0;
+}
 
-    if (outputRedirect) {
-        int fd = open(outputFile, O_WRONLY | O_CREAT | (outputRedirect ? O_APPEND : O_TRUNC), 0644);
-        if (fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
-        }
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
+// Up and down step through the history; stepping past the newest entry
+// brings back the line that was being typed
+void browseHistory(struct LineEditor *editor, int step) {
+    int64_t entry = (editor->browsing == -1 ? (int64_t) historyStore.count : editor->browsing) + step;
+    if (entry < 0 || (editor->browsing == -1 && step > 0)) {
+        editorPuts(editor, "\a");
+        return;
     }
+    if (editor->browsing == -1) {
+        free(editor->draft);
+        editor->draft = strndup(editor->buf, editor->len);
+    }
+    if (entry >= historyStore.count) {
+        setEditorLine(editor, editor->draft, strlen(editor->draft));
+        editor->browsing = -1;
+    } else {
+        const char *text = historyText(entry);
+        setEditorLine(editor, text, strlen(text));
+        editor->browsing = entry;
+    }
+}
 
-    if (errorRedirect) {
-        int fd = open(errorFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            perror("open");
-            exit(EXIT_FAILURE);
+// Ctrl-R: each keystroke narrows the search, Ctrl-R again steps to the
+// next older match. Enter runs the match and other keys edit it; Escape,
+// Ctrl-G or Ctrl-C leave the line as it was.
+void searchHistoryBackward(struct LineEditor *editor) {
+    char query[256] = "";
+    size_t queryLen = 0;
+    int64_t match = -1;
+    int failed = 0;
+    // The search takes the line's place, from its first row
+    moveEditorCursor(editor, editor->shownCursor, 0);
+    size_t drawn = editor->promptColumns;
+    while (1) {
+        const char *label = failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+        const char *text = match >= 0 ? historyText(match) : "";
+        returnToEditorRow(editor, drawn);
+        editorPuts(editor, label);
+        editorPuts(editor, query);
+        editorPuts(editor, "': ");
+        editorPuts(editor, text);
+        editorPuts(editor, "\x1b[J");
+        flushEditor(editor);
+        drawn = strlen(label) + editorColumns(query, 0, queryLen) + 3 + editorColumns(text, 0, strlen(text));
+
+        int key = readEditorKey(editor);
+        int64_t found = -1;
+        if (key == 18) {
+            found = queryLen > 0 ? findHistoryEntry(query, match >= 0 ? match : historyStore.count, 0) : -1;
+        } else if (key == 127 || key == 8) {
+            if (queryLen > 0) {
+                query[--queryLen] = '\0';
+            }
+            match = -1;
+            found = queryLen > 0 ? findHistoryEntry(query, historyStore.count, 0) : -1;
+        } else if (key >= 32 && key < 256 && key != 127 && queryLen + 1 < sizeof(query)) {
+            query[queryLen++] = (char) key;
+            query[queryLen] = '\0';
+            // The current match may still do
+            found = findHistoryEntry(query, match >= 0 ? match + 1 : historyStore.count, 0);
+        } else {
+            if (key != 27 && key != 7 && key != 3) {
+                if (match >= 0) {
+                    const char *text = historyText(match);
+                    setEditorLine(editor, text, strlen(text));
+                }
+                editor->pendingKey = key;
+            }
+            break;
+        }
+        failed = found < 0 && queryLen > 0;
+        if (found >= 0) {
+            match = found;
         }
-        dup2(fd, STDERR_FILENO);
-        close(fd);
     }
+    returnToEditorRow(editor, drawn);
+    redrawEditorLine(editor);
 }
 
+// Print candidates below the line in columns, the way ls does
+void listCompletions(struct LineEditor *editor, struct Completions *found) {
+    int width = (int) editor->width;
+    size_t longest = 0;
+    for (int i = 0; i < found->count; i++) {
+        size_t len = strlen(found->words[i]);
+        longest = len > longest ? len : longest;
+    }
+    int columns = width / (int) (longest + 2);
+    columns = columns < 1 ? 1 : columns;
+    int rows = (found->count + columns - 1) / columns;
 
-void handleBookmarkCommand(char *args[]) {
-    if (args[1] != NULL) {
-        if (strcmp(args[1], "-l") == 0) {
-            printBookmarks();
-        } else if (strcmp(args[1], "-i") == 0) {
-            if (args[2] != NULL) {
-                int index = atoi(args[2]);
-                if (index >= 0 && index < numBookmarks) {
-                    char *bookmarkArgs[MAX_LINE / 2 + 1];
-                    int i;
-                    for (i = 0; i <= MAX_LINE / 2; i++) {
-                        bookmarkArgs[i] = NULL;
-                    }
-                    // Tokenize the bookmark command
-                    char *token = strtok(bookmarks[index], " ");
-                    i = 0;
-                    while (token != NULL) {
-                        bookmarkArgs[i++] = token;
-                        token = strtok(NULL, " ");
-                    }
-                    executeCommand(bookmarkArgs, 0);
-                } else {
-                    printf("Invalid bookmark index.\n");
-                }
-            } else {
-                printf("Usage: bookmark -i <index>\n");
-            }
-        } else if (strcmp(args[1], "-d") == 0) {
-            if (args[2] != NULL) {
-                int index = atoi(args[2]);
-                if (index >= 0 && index < numBookmarks) {
-                    free(bookmarks[index]);
-                    // Shift the remaining bookmarks up
-                    for (int i = index; i < numBookmarks - 1; i++) {
-                        bookmarks[i] = bookmarks[i + 1];
-                    }
-                    numBookmarks--;
-                } else {
-                    printf("Invalid bookmark index.\n");
+    leaveEditorLine(editor);
+    for (int row = 0; row < rows; row++) {
+        for (int column = 0; column < columns; column++) {
+            int i = column * rows + row;
+            if (i >= found->count) {
+                break;
+            }
+            editorPuts(editor, found->words[i]);
+            if (column + 1 < columns && i + rows < found->count) {
+                for (size_t pad = strlen(found->words[i]); pad < longest + 2; pad++) {
+                    editorPuts(editor, " ");
                 }
-            } else {
-                printf("Usage: bookmark -d <index>\n");
             }
-        } else {
-            // Add a new bookmark
-            if (numBookmarks < MAX_BOOKMARKS) {
-                bookmarks[numBookmarks] = strdup(trimQuotes(args[1]));
-                numBookmarks++;
-            } else {
-                printf("Bookmark limit reached.\n");
+        }
+        editorPuts(editor, "\n");
+    }
+    if (found->total > (uint32_t) found->count) {
+        char more[64];
+        snprintf(more, sizeof(more), "... and %u more\n", found->total - (uint32_t) found->count);
+        editorPuts(editor, more);
+    }
+    redrawEditorLine(editor);
+}
+
+// Tab: commands in the first word of a pipeline stage, bookmark names
+// after "bookmark -i" or "-d", file names everywhere else. Completes as
+// far as the candidates agree; a second Tab lists them.
+void completeLine(struct LineEditor *editor) {
+    size_t start = editor->cursor;
+    while (start > 0 && editor->buf[start - 1] != ' ' && editor->buf[start - 1] != '|') {
+        start--;
+    }
+    char *word = arenaAlloc(&commandArena, editor->cursor - start + 1);
+    memcpy(word, editor->buf + start, editor->cursor - start);
+    word[editor->cursor - start] = '\0';
+    size_t before = start;
+    while (before > 0 && editor->buf[before - 1] == ' ') {
+        before--;
+    }
+    int commandPosition = before == 0 || editor->buf[before - 1] == '|';
+
+    struct Completions found = {arenaAlloc(&commandArena, EDITOR_LIST_MAX * sizeof(char *)), 0, 0, NULL};
+    if (commandPosition && strchr(word, '/') == NULL) {
+        syncCommandCompletions(&editor->commands);
+        completeFromTrie(&editor->commands.trie, word, &found);
+    } else if (strncmp(editor->buf, "bookmark ", 9) == 0 &&
+               (memmem(editor->buf, start, " -i ", 4) != NULL || memmem(editor->buf, start, " -d ", 4) != NULL)) {
+        // Few enough to rebuild on every Tab
+        refreshBookmarkStore();
+        struct Trie names;
+        initTrie(&names);
+        for (int i = 0; i < bookmarkStore.count; i++) {
+            if (*bookmarkStore.items[i].name != '\0') {
+                insertTrieWord(&names, bookmarkStore.items[i].name);
             }
         }
+        completeFromTrie(&names, word, &found);
+        freeTrie(&names);
     } else {
-        printf("Usage: bookmark <command>\n");
+        completeFilename(editor, word, &found);
     }
-}
 
-void printBookmarks() {
-    for (int i = 0; i < numBookmarks; i++) {
-        printf("%d \"%s\"\n", i, bookmarks[i]);
+    size_t wordLen = strlen(word);
+    if (found.total == 0) {
+        editorPuts(editor, "\a");
+    } else if (strlen(found.common) > wordLen || found.total == 1) {
+        insertEditorText(editor, found.common + wordLen, strlen(found.common) - wordLen);
+        if (found.total == 1 && found.common[strlen(found.common) - 1] != '/') {
+            insertEditorText(editor, " ", 1);
+        }
+    } else if (editor->lastKey == '\t') {
+        listCompletions(editor, &found);
+    } else {
+        editorPuts(editor, "\a");
     }
 }
 
-void searchInFile(char *filename, char *keyword) {
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
+// Use the editor when a person is typing at a terminal that can take it
+void initLineEditor(struct LineEditor *editor) {
+    const char *term = getenv("TERM");
+    if (!interactive || !isatty(STDOUT_FILENO) || term == NULL || strcmp(term, "dumb") == 0) {
         return;
     }
+    editor->raw = shellTermios;
+    editor->raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    editor->raw.c_iflag &= ~(ICRNL | IXON);
+    editor->raw.c_cc[VMIN] = 1;
+    editor->raw.c_cc[VTIME] = 0;
+    editor->cap = INPUT_BUFFER_SIZE;
+    editor->buf = malloc(editor->cap);
+    editor->shownCap = editor->cap;
+    editor->shown = malloc(editor->shownCap);
+    // Character widths come from the locale; the editor itself assumes UTF-8
+    if (setlocale(LC_CTYPE, "") == NULL || MB_CUR_MAX == 1) {
+        setlocale(LC_CTYPE, "C.UTF-8");
+    }
+    struct sigaction sa = {0};
+    sa.sa_handler = handleSIGWINCH;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+    editor->enabled = 1;
+}
+
+// Read one line in raw mode with editing, history and completion. Returns
+// it NUL-terminated, valid until the next call, or NULL at end of input.
+char *editLine(struct LineEditor *editor, const char *prompt, size_t *length) {
+    editor->prompt = prompt;
+    editor->promptColumns = editorColumns(prompt, 0, strlen(prompt));
+    editorResized = 0;
+    updateEditorWidth(editor);
+    editor->len = editor->cursor = 0;
+    editor->shownLen = editor->shownCursor = 0;
+    editor->browsing = -1;
+    editor->lastKey = 0;
+    fflush(stdout);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor->raw);
+    editorPuts(editor, prompt);
+    flushEditor(editor);
+
+    int key;
+    while ((key = readEditorKey(editor)) != '\r' && key != '\n') {
+        size_t at = editor->cursor;
+        if (editorResized) {
+            // The line is laid out for the new width from this key on
+            editorResized = 0;
+            updateEditorWidth(editor);
+        }
+        if (key == -1 || (key == 4 && editor->len == 0)) {
+            editorPuts(editor, "\n");
+            flushEditor(editor);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &shellTermios);
+            return NULL;
+        } else if (key == 3) {
+            // Ctrl-C drops the line
+            editor->cursor = editor->len;
+            refreshEditorLine(editor);
+            editorPuts(editor, "^C\n");
+            editorPuts(editor, prompt);
+            editor->len = editor->cursor = editor->shownLen = editor->shownCursor = 0;
+            editor->browsing = -1;
+        } else if (key == 127 || key == 8) {
+            while (at > 0 && isUtf8Continuation(editor->buf[--at])) {
+            }
+            deleteEditorText(editor, at, editor->cursor);
+        } else if (key == EDITOR_KEY_DELETE || key == 4) {
+            if (at < editor->len) {
+                while (++at < editor->len && isUtf8Continuation(editor->buf[at])) {
+                }
+                deleteEditorText(editor, editor->cursor, at);
+            }
+        } else if (key == EDITOR_KEY_LEFT || key == 2) {
+            while (editor->cursor > 0 && isUtf8Continuation(editor->buf[--editor->cursor])) {
+            }
+        } else if (key == EDITOR_KEY_RIGHT || key == 6) {
+            while (editor->cursor < editor->len && isUtf8Continuation(editor->buf[++editor->cursor])) {
+            }
+        } else if (key == EDITOR_KEY_HOME || key == 1) {
+            editor->cursor = 0;
+        } else if (key == EDITOR_KEY_END || key == 5) {
+            editor->cursor = editor->len;
+        } else if (key == 11) {
+            editor->len = editor->cursor;
+        } else if (key == 21) {
+            deleteEditorText(editor, 0, editor->cursor);
+        } else if (key == 23) {
+            // Ctrl-W: the word before the cursor and the spaces after it
+            while (at > 0 && editor->buf[at - 1] == ' ') {
+                at--;
+            }
+            while (at > 0 && editor->buf[at - 1] != ' ') {
+                at--;
+            }
+            deleteEditorText(editor, at, editor->cursor);
+        } else if (key == 12) {
+            editorPuts(editor, "\x1b[H\x1b[2J");
+            redrawEditorLine(editor);
+        } else if (key == EDITOR_KEY_UP || key == 16) {
+            browseHistory(editor, -1);
+        } else if (key == EDITOR_KEY_DOWN || key == 14) {
+            browseHistory(editor, 1);
+        } else if (key == 18) {
+            searchHistoryBackward(editor);
+        } else if (key == '\t') {
+            completeLine(editor);
+        } else if (key >= 32 && key < 256 && key != 127) {
+            // A UTF-8 character goes in whole, so the screen never holds half of one
+            char text[4] = {(char) key};
+            size_t len = 1;
+            int more = key >= 0xF0 ? 3 : key >= 0xE0 ? 2 : key >= 0xC0 ? 1 : 0;
+            for (int byte; more-- > 0 && (byte = readEditorByte(50)) != -1;) {
+                text[len++] = (char) byte;
+            }
+            insertEditorText(editor, text, len);
+        }
+        editor->lastKey = key;
+        refreshEditorLine(editor);
+        flushEditor(editor);
+    }
+
+    refreshEditorLine(editor);
+    leaveEditorLine(editor);
+    flushEditor(editor);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shellTermios);
+    editor->buf[editor->len] = '\0';
+    *length = editor->len;
+    return editor->buf;
+}
+
+// Read and run commands, one per line, until the reader runs dry
+void runCommandLines(struct LineReader *reader) {
+    char *line;
+    size_t length;
+    int background;
+    char **args;
+
+    while (1) {
+        arenaReset(&commandArena);
+        notifyFinishedJobs();
+        if (interactive && !lineEditor.enabled) {
+            printf("myshell: ");
+        }
+        fflush(stdout);  // Flush the output buffer
+
+        if (interactive) {
+            refreshHistory();
+        }
+        line = lineEditor.enabled ? editLine(&lineEditor, "myshell: ", &length) : readLine(reader, &length);
+        if (line == NULL) {
+            return;
+        }
+        while (*line == ' ' || *line == '\t') {
+            line++;
+            length--;
+        }
+        if (*line == '#') {
+            continue;  // Comments and "#!" lines in scripts
+        }
 
-    char line[256];
-    int line_number = 0;
+        if (interactive) {
+            line = expandHistory(line, &length);
+            if (line == NULL) {
+                lastStatus = 1;
+                continue;
+            }
+        }
+        char *entry = interactive ? arenaStrdup(&commandArena, line) : NULL;
 
-    while (fgets(line, sizeof(line), file) != NULL) {
-        line_number++;
+        background = 0;
+        args = setup(line, length, &background);
+        if (args[0] == NULL) {
+            continue;
+        }
 
-        // Search for the word in the line
-        if (strstr(line, keyword) != NULL) {
-            printf("%d:  '%s' -> %s\n", line_number, filename, line);
+        struct timespec start, end;
+        time_t started = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        runCommand(args, background);
+        if (entry != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            addHistory(entry, lastStatus, started, secondsBetween(&start, &end));
         }
     }
+}
 
-    fclose(file);
+// Send one frame, passing fds along with its first byte if there are any
+int sendFrame(int sock, uint32_t type, const void *data, size_t len, const int *fds, int numFds) {
+    struct ServeFrame frame = {type, (uint32_t) len};
+    struct iovec iov[2] = {{&frame, sizeof(frame)}, {(void *) data, len}};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+    if (numFds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(numFds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numFds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, numFds * sizeof(int));
+    }
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        // Step past what went out; short writes are rare but legal
+        while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
 }
 
-void searchFilesRecursive(char *path, char *keyword) {
-    DIR *dir;
-    struct dirent *ent;
-
-    if ((dir = opendir(path)) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            if (ent->d_type == DT_DIR) {
-                // Ignore "." and ".." directories
-                if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-                    char new_path[255];
-                    strcpy(new_path, path);
-                    strcat(new_path, "/");
-                    strcat(new_path, ent->d_name);
-                    searchFiles(new_path, keyword, 1);
+// Fill buf from the socket, keeping any fds that arrive on the way
+int receiveFull(int sock, void *buf, size_t len, struct ServeRequest *request) {
+    while (len > 0) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+        } control;
+        struct iovec iov = {buf, len};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int *fds = (int *) CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++) {
+                if (request != NULL && request->numFds < SERVE_MAX_FDS) {
+                    request->fds[request->numFds++] = fds[i];
+                } else {
+                    close(fds[i]);
                 }
             }
         }
-        closedir(dir);
-    } else {
-        perror("Error opening directory");
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Frames up to and including SERVE_COMMAND. The working directory and
+// environment are applied as they arrive; this process is the request's own.
+int receiveRequest(int sock, struct ServeRequest *request) {
+    memset(request, 0, sizeof(*request));
+    while (1) {
+        struct ServeFrame frame;
+        if (receiveFull(sock, &frame, sizeof(frame), request) == -1 || frame.length > SERVE_MAX_FRAME) {
+            return -1;
+        }
+        char *payload = malloc(frame.length + 1);
+        if (receiveFull(sock, payload, frame.length, request) == -1) {
+            free(payload);
+            return -1;
+        }
+        payload[frame.length] = '\0';
+
+        if (frame.type == SERVE_CWD) {
+            if (chdir(payload) == -1 && request->error == NULL) {
+                // Reported once the client has finished sending
+                request->error = malloc(frame.length + 64);
+                sprintf(request->error, "cd: %s: %s\n", payload, strerror(errno));
+            }
+        } else if (frame.type == SERVE_ENV) {
+            char *equals = strchr(payload, '=');
+            if (equals != NULL) {
+                *equals = '\0';
+                setenv(payload, equals + 1, 1);
+            }
+        } else if (frame.type == SERVE_COMMAND) {
+            request->command = payload;
+            return request->error != NULL;
+        }
+        free(payload);
     }
 }
 
-void searchFiles(char *path, char *keyword, int recursive) {
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(path)) != NULL) {
-        while ((ent = readdir(dir)) != NULL) {
-            if (ent->d_type == DT_REG && ((strstr(ent->d_name, ".c") != NULL) || (strstr(ent->d_name, ".C") != NULL) || (strstr(ent->d_name, ".h") != NULL) || (strstr(ent->d_name, ".H") != NULL)) ) {
-                // Construct the full path for the file
-                char file_path[255];
-                strcpy(file_path, path);
-                strcat(file_path, "/");
-                strcat(file_path, ent->d_name);
-                searchInFile(file_path, keyword);
-            } else if (recursive && ent->d_type == DT_DIR &&
-                       strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-                // Construct the full path for the subdirectory
-                char sub_dir_path[255];
-                strcpy(sub_dir_path, path);
-                strcat(sub_dir_path, "/");
-                strcat(sub_dir_path, ent->d_name);
-                searchFilesRecursive(sub_dir_path, keyword);
+// One connection, in its own process. A runner process executes the
+// command lines with stdout and stderr either on the fds the client passed
+// or on pipes that this process relays to the client as frames. The exit
+// status goes back last.
+void serveConnection(int sock) {
+    struct ServeRequest request;
+    int result = receiveRequest(sock, &request);
+    if (result != 0) {
+        if (result == 1) {
+            int32_t status = 1;
+            sendFrame(sock, SERVE_STDERR, request.error, strlen(request.error), NULL, 0);
+            sendFrame(sock, SERVE_EXIT, &status, sizeof(status), NULL, 0);
+        }
+        exit(1);
+    }
+
+    int direct = request.numFds == 2;
+    int outputs[2][2] = {{-1, -1}, {-1, -1}};
+    if (!direct && (pipe2(outputs[0], O_CLOEXEC) == -1 || pipe2(outputs[1], O_CLOEXEC) == -1)) {
+        exit(1);
+    }
+
+    // The runner is waited for here, not through the job table
+    signal(SIGCHLD, SIG_DFL);
+    pid_t runner = fork();
+    if (runner == 0) {
+        close(sock);
+        int nullFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        dup2(nullFd, STDIN_FILENO);
+        close(nullFd);
+        dup2(direct ? request.fds[0] : outputs[0][1], STDOUT_FILENO);
+        dup2(direct ? request.fds[1] : outputs[1][1], STDERR_FILENO);
+        initJobControl();
+        struct LineReader reader;
+        initStringReader(&reader, request.command);
+        runCommandLines(&reader);
+        exit(lastStatus);
+    }
+    for (int i = 0; i < request.numFds; i++) {
+        close(request.fds[i]);
+    }
+
+    if (!direct) {
+        close(outputs[0][1]);
+        close(outputs[1][1]);
+        struct pollfd fds[2] = {{outputs[0][0], POLLIN, 0}, {outputs[1][0], POLLIN, 0}};
+        uint32_t types[2] = {SERVE_STDOUT, SERVE_STDERR};
+        char buffer[INPUT_BUFFER_SIZE];
+        int numOpen = 2;
+        while (numOpen > 0) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            for (int i = 0; i < 2; i++) {
+                if (fds[i].fd == -1 || fds[i].revents == 0) {
+                    continue;
+                }
+                ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+                if (n > 0 && sendFrame(sock, types[i], buffer, n, NULL, 0) == 0) {
+                    continue;
+                }
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+                // End of output, or the client went away: the runner gets
+                // SIGPIPE on its next write
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                numOpen--;
             }
         }
-        closedir(dir);
-    } else {
-        perror("Error opening directory");
     }
 
-    if (recursive) {
-        searchFilesRecursive(path, keyword);
+    int status;
+    while (waitpid(runner, &status, 0) == -1 && errno == EINTR) {
     }
+    int32_t code = runner > 0 ? exitCode(status) : 127;
+    sendFrame(sock, SERVE_EXIT, &code, sizeof(code), NULL, 0);
+    exit(0);
 }
 
-int main(void) {
-    char inputBuffer[MAX_LINE];
-    int background;
-    char *args[MAX_LINE / 2 + 1];
+// OPshell --serve path: accept connections for as long as the process
+// lives, each handled by a fork of this shell, so every request starts
+// with the command cache, bookmarks and job-free state already warm
+void runServer(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "--serve: socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);  // Left behind by an earlier server
+    }
+    if (listener == -1 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listener, SOMAXCONN) == -1) {
+        perror("--serve");
+        exit(1);
+    }
+
+    warmCommandCache();
     while (1) {
-        printf("myshell: ");
-        fflush(stdout);  // Flush the output buffer
+        int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        drainChildEvents();
+        if (sock == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            continue;
+        }
+        warmCommandCache();
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            serveConnection(sock);
+        }
+        if (pid == -1) {
+            perror("fork");
+        }
+        close(sock);
+    }
+}
 
-        background = 0;
-        setup(inputBuffer, args, &background);
+// OPshell --connect path [--cwd dir] [--env NAME=value]... [--direct] -c 'commands'
+// Runs the commands on a server and exits with their status. --direct
+// hands the server this process's stdout and stderr instead of relaying.
+int runClient(const char *path, char *argv[]) {
+    const char *cwd = NULL;
+    const char *command = NULL;
+    int direct = 0;
+    int numEnv = 0;
+    char **env = argv;
+    for (int i = 0; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "--cwd") == 0 && argv[i + 1] != NULL) {
+            cwd = argv[++i];
+        } else if (strcmp(argv[i], "--env") == 0 && argv[i + 1] != NULL) {
+            env[numEnv++] = argv[++i];
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            direct = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && argv[i + 1] != NULL) {
+            command = argv[++i];
+        } else {
+            command = NULL;
+            break;
+        }
+    }
+    if (command == NULL) {
+        fprintf(stderr, "Usage: OPshell --connect <socket> [--cwd dir] [--env NAME=value]... [--direct] -c <commands>\n");
+        return 2;
+    }
 
-        // Check for internal commands
-        if (!handleInternalCommands(args)) {
-            // If it's not an internal command, execute the command
-            // Check for I/O redirection
-            handleIOredirection(args);
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(path);
+        return 127;
+    }
+
+    // Default to running where the client is, as a local shell would
+    char here[PATH_MAX];
+    if (cwd == NULL && getcwd(here, sizeof(here)) != NULL) {
+        cwd = here;
+    }
+    int ok = cwd == NULL || sendFrame(sock, SERVE_CWD, cwd, strlen(cwd), NULL, 0) == 0;
+    for (int i = 0; ok && i < numEnv; i++) {
+        ok = sendFrame(sock, SERVE_ENV, env[i], strlen(env[i]), NULL, 0) == 0;
+    }
+    if (ok && direct) {
+        int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+        ok = sendFrame(sock, SERVE_FDS, NULL, 0, fds, 2) == 0;
+    }
+    if (ok) {
+        sendFrame(sock, SERVE_COMMAND, command, strlen(command), NULL, 0);
+    }
+    // Even if sending failed, the server may have said why before closing
+
+    char *payload = malloc(SERVE_MAX_FRAME);
+    struct ServeFrame frame;
+    while (receiveFull(sock, &frame, sizeof(frame), NULL) == 0 && frame.length <= SERVE_MAX_FRAME &&
+           receiveFull(sock, payload, frame.length, NULL) == 0) {
+        if (frame.type == SERVE_STDOUT) {
+            writeOutput(STDOUT_FILENO, payload, frame.length);
+        } else if (frame.type == SERVE_STDERR) {
+            writeOutput(STDERR_FILENO, payload, frame.length);
+        } else if (frame.type == SERVE_EXIT && frame.length == sizeof(int32_t)) {
+            int32_t status;
+            memcpy(&status, payload, sizeof(status));
+            return status;
+        }
+    }
+    fprintf(stderr, "%s: connection closed\n", path);
+    return 127;
+}
 
-            // Execute the command
-            executeCommand(args, background);
+#ifndef OPSHELL_NO_MAIN
+int main(int argc, char *argv[]) {
+    struct LineReader reader;
 
+    if (argc > 2 && strcmp(argv[1], "--connect") == 0) {
+        return runClient(argv[2], argv + 3);
+    } else if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+        // OPshell --serve /run/opshell.sock
+        initJobControl();
+        loadBookmarkStore();
+        runServer(argv[2]);
+    } else if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        // OPshell -c 'command; one per line'
+        initStringReader(&reader, argv[2]);
+    } else if (argc > 1) {
+        // OPshell script.sh
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            perror(argv[1]);
+            exit(127);
         }
+        initLineReader(&reader, fd);
+    } else {
+        initLineReader(&reader, STDIN_FILENO);
+        interactive = isatty(STDIN_FILENO);
     }
-    return 0;
+
+    initJobControl();
+    loadBookmarkStore();
+    if (interactive) {
+        loadHistory();
+        initLineEditor(&lineEditor);
+    }
+    runCommandLines(&reader);
+    exit(lastStatus);
 }
+#endif
 
+// Returns str without surrounding double quotes, allocated in the command arena
 char* trimQuotes(const char *str) {
     size_t len = strlen(str);
 
     // Check if the string has at least two characters and starts with a quote
     if (len >= 2 && str[0] == '"' && str[len - 1] == '"') {
-        // Allocate memory for the trimmed string
-        char *trimmed = (char*)malloc(len - 1);
-        if (trimmed == NULL) {
-            // Handle memory allocation failure
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(EXIT_FAILURE);
-        }
+        char *trimmed = arenaAlloc(&commandArena, len - 1);
 
         // Copy characters to the new memory location, excluding the first and last quotes
-        strncpy(trimmed, str + 1, len - 2);
+        memcpy(trimmed, str + 1, len - 2);
 
         // Null-terminate the trimmed string
         trimmed[len - 2] = '\0';
@@ -436,7 +6390,7 @@ char* trimQuotes(const char *str) {
         return trimmed;
     } else {
         // If no trimming is needed, return a duplicate of the original string
-        return strdup(str);
+        return arenaStrdup(&commandArena, str);
     }
 }
 
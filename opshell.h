@@ -0,0 +1,768 @@
+#ifndef OPSHELL_H
+#define OPSHELL_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <locale.h>
+#include <wchar.h>
+#include <sys/resource.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_SIMD 1
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// IORING_FEAT_RW_CUR_POS arrived with the openat/statx/read/close opcodes (5.6)
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define SEARCH_URING 1
+#endif
+#endif
+
+#define INPUT_BUFFER_SIZE 65536 // Block size for reading commands from scripts and pipes
+#define ARENA_CHUNK_SIZE 65536  // Per-command scratch memory comes in chunks of this size
+#define MAX_PATH 256
+#define COMMAND_CACHE_BUCKETS 256
+#define PATH_RECHECK_INTERVAL 1 // Seconds between PATH directory mtime checks
+#define SEARCH_WINDOW 1024      // Files in flight between the walker and the output
+#define SEARCH_MMAP_MIN 16384   // Smaller files are cheaper to read() than to map
+#define SEARCH_URING_BATCH 32   // Files a scanner opens and reads per io_uring submission
+#define SEARCH_DENTS_BUFFER 65536 // Bytes of directory entries fetched per getdents64
+#define SEARCH_OUTPUT_BUFFER (1 << 20) // Results are written to stdout in chunks of this size
+#define SEARCH_EXT_SLOTS 128    // Open-addressed table of file extensions for -t
+#define SEARCH_AC_MATCH 0x80000000u // Set on automaton transitions into a state that reports a pattern
+#define PIPELINE_PIPE_SIZE (1 << 20) // Requested capacity of pipes between stages
+#define CHILD_EVENT_RING 1024   // Wait statuses the SIGCHLD handler can queue
+#define STATS_BUCKETS 128
+#define STATS_WINDOW 256        // Recent wall times kept per command for percentiles
+#define SEARCH_INDEX_FILE ".opshell_index"
+#define SEARCH_INDEX_MAGIC "OPSIDX1"
+#define BOOKMARK_FILE ".opshell_bookmarks" // In $HOME unless $OPSHELL_BOOKMARKS names another file
+#define EDITOR_LIST_MAX 200                 // Completions listed at most on a second Tab
+#define EDITOR_DIR_CACHE 16                 // Directory listings kept for filename completion
+#define HISTORY_FILE ".opshell_history"     // In $HOME unless $OPSHELL_HISTORY names another file
+#define HISTORY_MAGIC 0x54534850u           // "PHST" at the start of every record
+#define HISTORY_TRIGRAM_BITS 16
+#define HISTORY_TRIGRAM_BUCKETS (1 << HISTORY_TRIGRAM_BITS)
+#define BOOKMARK_MAGIC "OPSBMK1"
+#define SERVE_MAX_FRAME (1 << 20) // Largest frame either side of --serve accepts
+#define SERVE_MAX_FDS 3         // Descriptors a request may pass with SCM_RIGHTS
+
+// Where "2>&1" sends stderr: to stdout as redirected, or, when it was
+// written before the ">", to the stdout the command started with
+enum ErrorToOutput { STDERR_UNCHANGED, STDERR_TO_STDOUT, STDERR_TO_ORIGINAL_STDOUT };
+
+// Redirections parsed out of a command line, applied only in the child
+struct IORedirection {
+    char *inputFile;
+    char *outputFile;
+    int outputFlags;            // O_TRUNC for ">", O_APPEND for ">>"
+    char *errorFile;
+    enum ErrorToOutput errorToOutput;
+};
+
+// A command the shell runs in its own process. Handlers report failure
+// through lastStatus.
+struct Builtin {
+    const char *name;
+    void (*handler)(char *args[]);
+};
+
+// Everything needed to start one external command. stdinFd/stdoutFd/stderrFd
+// of -1 keep the shell's descriptors; pgid 0 starts a new process group.
+struct LaunchRequest {
+    const char *commandPath;
+    char **args;
+    struct IORedirection *redirection;
+    int background;
+    pid_t pgid;
+    int stdinFd;
+    int stdoutFd;
+    int stderrFd;
+    int foreground;             // Hand the terminal to the new process group
+};
+
+// Hands out complete lines from a large block buffer, so piped or scripted
+// input is split exactly at newlines however the reads happen to fall
+struct LineReader {
+    int fd;                     // -1 when reading from a fixed string
+    char *buf;
+    size_t start;
+    size_t end;
+    size_t cap;
+    int eof;
+};
+
+// Bump allocator for everything that only lives as long as one command:
+// argv vectors, trimmed strings, pipeline plans. Chunks are kept across
+// commands, so after warm-up a command allocates nothing from malloc and
+// reset is O(1).
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaChunk *first;
+    struct ArenaChunk *current;
+};
+
+
+// A directory from $PATH together with the mtime it had when last checked
+struct PathDir {
+    char *dir;
+    struct timespec mtime;
+    int exists;
+};
+
+// Maps a command name to its absolute path; path == NULL is a cached miss
+struct CommandCacheEntry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct CommandCacheEntry *next;
+};
+
+struct CommandCache {
+    struct CommandCacheEntry *buckets[COMMAND_CACHE_BUCKETS];
+    int numEntries;
+    char *pathValue;     // The $PATH value the cache was built against
+    struct PathDir *dirs;
+    int numDirs;
+    time_t lastCheck;
+};
+
+// Growable byte buffer a scanner formats its results into
+struct OutputBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct FileList {
+    char **paths;
+    size_t count;
+    size_t cap;
+};
+
+// The patterns one search looks for. A single pattern is matched with
+// findSubstring(); two or more are compiled into an Aho-Corasick DFA whose
+// rows are indexed by byte class rather than by byte.
+struct SearchMatcher {
+    char **patterns;
+    size_t *lengths;
+    int numPatterns;
+    uint16_t classes[256];      // Byte -> class; bytes in no pattern share class 0
+    int numClasses;
+    uint8_t startBytes[256];    // Bytes that can leave the root state
+    uint8_t startLo[16];        // The same set as nibble tables for SIMD; see skipToStartByte()
+    uint8_t startHi[16];
+    uint32_t *next;             // [row + class] -> next row, | SEARCH_AC_MATCH
+    int32_t *match;             // State -> pattern it reports, or -1
+    uint32_t numStates;
+};
+
+// How each hit is written. Text is for people; JSON (one object per line)
+// and NUL-separated fields are for programs and carry byte offsets.
+enum SearchFormat {
+    SEARCH_FORMAT_TEXT,
+    SEARCH_FORMAT_JSON,
+    SEARCH_FORMAT_NULL
+};
+
+// What is reported per file: every matching line, how many, or only the name
+enum SearchMode {
+    SEARCH_MODE_LINES,
+    SEARCH_MODE_COUNT,
+    SEARCH_MODE_FILES
+};
+
+// How scanners get file contents into memory
+enum SearchIo {
+    SEARCH_IO_SYNC,             // open/fstat/read-or-mmap/close, one file at a time
+    SEARCH_IO_URING             // Batched openat/statx/read/close through io_uring
+};
+
+// Which files a search looks at. Extensions are up to 8 bytes, lowercased
+// and packed into a uint64_t, so testing a name is one hash probe.
+struct SearchFilter {
+    uint64_t extensions[SEARCH_EXT_SLOTS]; // 0 marks an empty slot
+    int numExtensions;          // 0: no extension filter
+    char **includes;            // File name globs; when given, one must match
+    int numIncludes;
+    char **excludes;            // File and directory name globs
+    int numExcludes;
+    int useIgnoreFiles;         // Honour .gitignore and .ignore
+};
+
+// Everything a search does besides what it looks for
+struct SearchOptions {
+    int recursive;
+    int numWorkers;
+    enum SearchIo ioMode;
+    enum SearchFormat format;
+    enum SearchMode mode;
+    struct SearchFilter filter;
+};
+
+// One line of a .gitignore or .ignore file
+struct SearchIgnoreRule {
+    char *pattern;
+    int negate;                 // "!pattern": re-include
+    int dirOnly;                // "pattern/": directories only
+    int anchored;               // Contains a '/': matched against the path from the ignore file's directory
+    int anyDepth;               // "**/pattern": matched against every trailing part of that path
+};
+
+struct SearchIgnore {
+    struct SearchIgnoreRule *rules;
+    int numRules;
+};
+
+// A directory the walker has entered. Files are opened relative to its fd,
+// so no path is built unless something has to be printed. refs counts the
+// walker, queued files and child directories (which need the name chain);
+// fdUsers counts only the walker and queued files, and the fd is closed as
+// soon as that drops to zero.
+struct SearchDir {
+    struct SearchEngine *engine;
+    struct SearchDir *parent;
+    char *name;                 // Relative to parent; the root's is the path given
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct SearchIgnore *ignore; // Rules from this directory's ignore files, if any
+    atomic_int refs;
+    atomic_int fdUsers;
+};
+
+// One file to scan; seq is its position in walk order
+struct SearchTask {
+    unsigned long seq;
+    struct SearchDir *dir;      // NULL when name is a path from the cwd
+    char *name;
+    char *path;                 // Built on first use; see searchTaskPath()
+    enum SearchFormat format;
+    enum SearchMode mode;
+    unsigned long count;        // Matching lines so far
+    struct OutputBuffer output;
+    int done;
+};
+
+// A scanner's deque: the owner takes from the head, thieves from the tail
+struct SearchQueue {
+    struct SearchTask **items;
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+// The walker hands files out round-robin to per-scanner deques; idle
+// scanners steal from their neighbours. At most SEARCH_WINDOW files are in
+// flight, and results are written strictly in walk order so output is the
+// same no matter how many scanners ran.
+struct SearchEngine {
+    char *root;
+    struct SearchMatcher *matcher;
+    struct SearchOptions *options;
+    struct FileList *files;     // Scan these instead of walking root
+    struct FileList *collect;   // Only record walked files, scan nothing
+    int numWorkers;
+    struct SearchQueue *queues;
+    pthread_t *workers;
+    pthread_t walker;
+
+    pthread_mutex_t lock;       // Guards everything below
+    pthread_cond_t workReady;
+    pthread_cond_t slotFree;
+    pthread_cond_t taskDone;
+    struct SearchTask *window[SEARCH_WINDOW];
+    unsigned long nextSeq;
+    unsigned long nextEmit;
+    size_t queued;
+    unsigned int nextQueue;
+    int walkDone;
+    pthread_cond_t dirClosed;
+    int openDirs;               // Directory fds open, the walker's own included
+    int walkDepth;              // Of those, the ones the walker is inside
+    int maxOpenDirs;
+};
+
+#ifdef SEARCH_URING
+// One scanner's io_uring instance, driven with raw syscalls. The ring
+// indices are shared with the kernel and published with atomics.
+struct SearchRing {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned queued;            // Prepared, not yet submitted
+    unsigned inFlight;          // Submitted, completion not yet reaped
+};
+
+// Per-file state while a batch moves through the ring
+struct SearchIoSlot {
+    struct SearchTask *task;
+    int fd;
+    int error;
+    struct statx stx;
+    char *buf;
+    size_t len;
+};
+#endif
+
+// On-disk trigram index layout. The file is written once and mapped
+// read-only at query time; offsets are from the start of the file.
+struct SearchIndexHeader {
+    char magic[8];
+    uint32_t numFiles;
+    uint32_t numTrigrams;
+    uint64_t filesOffset;
+    uint64_t pathsOffset;
+    uint64_t trigramsOffset;
+    uint64_t postingsOffset;
+    uint64_t size;
+};
+
+// Size and mtime are what a refresh compares to decide whether to re-read
+struct SearchIndexFile {
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t pathOffset;
+};
+
+// Posting list of file ids (ascending) containing a trigram
+struct SearchIndexTrigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;            // In uint32_t units from postingsOffset
+};
+
+struct SearchIndex {
+    char *map;
+    size_t size;
+    struct SearchIndexHeader *header;
+    struct SearchIndexFile *files;
+    const char *paths;
+    struct SearchIndexTrigram *trigrams;
+    uint32_t *postings;
+};
+
+// On-disk bookmark store: a header, then one 8-byte aligned record per
+// bookmark. Each record is followed by its name, command text, resolved
+// path and argv strings, every one NUL-terminated. The whole file is
+// rewritten and renamed into place on each change.
+struct BookmarkFileHeader {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+struct BookmarkRecord {
+    uint32_t size;              // Header and strings, padded to 8 bytes
+    uint16_t argc;
+    uint8_t background;
+    uint8_t reserved;
+    uint32_t nameLen;           // 0 for an unnamed bookmark
+    uint32_t commandLen;
+    uint32_t pathLen;           // 0 when the command is run through runCommand
+    uint32_t argsLen;           // All argv strings with their terminators
+};
+
+// A bookmark ready to launch; the strings point into the store's image
+struct Bookmark {
+    const char *name;
+    const char *command;
+    const char *path;
+    char **argv;
+    int argc;
+    int background;
+};
+
+struct BookmarkStore {
+    char *filename;
+    char *image;                // The mapped file, or a heap copy after a change
+    size_t size;
+    int mapped;
+    struct Bookmark *items;
+    int count;
+    // Identity of the file the image came from, to notice other shells' writes
+    dev_t dev;
+    ino_t ino;
+    off_t fileSize;
+    struct timespec mtime;
+};
+
+// One command in the history log, followed by its NUL-terminated text
+// and zero padding to a multiple of 8 bytes. The log is only ever
+// appended to, by every shell sharing the file.
+struct HistoryRecord {
+    uint32_t magic;
+    uint32_t size;              // Whole record, padding included
+    int64_t started;            // Wall-clock time the command started
+    uint64_t durationNs;
+    int32_t status;
+    uint32_t reserved;
+};
+
+// Distinct lines with a trigram in one bucket, oldest first
+struct HistoryPostings {
+    uint32_t *lines;
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct HistoryStore {
+    char *filename;
+    int fd;                     // Opened O_APPEND; -1 without a history file
+    char *image;                // The log, mapped shared and read-only
+    size_t mapped;
+    size_t parsed;              // Bytes of the image indexed so far
+    uint64_t *entries;          // Offset of every record, oldest first
+    uint32_t count;
+    uint32_t cap;
+    // Distinct command lines, each as its newest entry, found by text
+    // through lineTable (line + 1 per slot, 0 for empty) and by
+    // substring through the trigram postings
+    uint32_t *latest;
+    uint32_t numLines;
+    uint32_t linesCap;
+    uint32_t *lineTable;
+    uint32_t tableSize;
+    struct HistoryPostings *postings;
+};
+
+// Prefix tree of names for Tab completion. Nodes live in one array, node 0
+// is the root, and each node's children form a sibling list in byte order.
+struct TrieNode {
+    uint32_t child;             // First child, 0 for none
+    uint32_t sibling;
+    uint32_t words;             // Words that end at or below this node
+    unsigned char byte;
+    unsigned char terminal;
+};
+
+struct Trie {
+    struct TrieNode *nodes;
+    uint32_t count;
+    uint32_t cap;
+};
+
+// Executables on $PATH plus builtins, and the $PATH directory mtimes
+// they were read at
+struct CommandCompletions {
+    struct Trie trie;
+    char *pathValue;
+    struct timespec *mtimes;
+    int numDirs;
+};
+
+// One directory's sorted names for filename completion; directories end in '/'
+struct DirListing {
+    char *dir;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char **names;
+    int count;
+    unsigned long used;         // Editor tick of the last use
+};
+
+struct Completions {
+    char **words;               // The first EDITOR_LIST_MAX candidates
+    int count;
+    uint32_t total;
+    char *common;               // What every candidate starts with
+};
+
+enum EditorKey {
+    EDITOR_KEY_UP = 256,
+    EDITOR_KEY_DOWN,
+    EDITOR_KEY_RIGHT,
+    EDITOR_KEY_LEFT,
+    EDITOR_KEY_HOME,
+    EDITOR_KEY_END,
+    EDITOR_KEY_DELETE,
+};
+
+// The raw-mode line editor used at an interactive prompt. shown mirrors
+// what the terminal displays after the prompt, so a keystroke only
+// rewrites from the first byte that differs.
+struct LineEditor {
+    int enabled;
+    struct termios raw;
+    const char *prompt;
+    size_t promptColumns;
+    size_t width;               // Terminal columns; a longer line wraps onto more rows
+    char *buf;
+    size_t len;
+    size_t cursor;
+    size_t cap;
+    char *shown;
+    size_t shownLen;
+    size_t shownCursor;
+    size_t shownCap;
+    char *out;                  // Terminal output for the current keystroke
+    size_t outLen;
+    size_t outCap;
+    int pendingKey;
+    int lastKey;
+    int64_t browsing;           // History entry on the line, -1 for a new line
+    char *draft;                // The new line, kept while browsing
+    struct CommandCompletions commands;
+    struct DirListing dirs[EDITOR_DIR_CACHE];
+    unsigned long tick;
+};
+
+enum LaunchPath { LAUNCH_SPAWN, LAUNCH_FORK };
+
+// Counts which launch path each external command took
+struct LaunchStats {
+    unsigned long spawnLaunches;
+    unsigned long forkLaunches;
+    unsigned long spawnFallbacks;
+    enum LaunchPath lastPath;
+};
+
+enum JobState { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct JobProcess {
+    pid_t pid;
+    char *name;
+    enum JobState state;
+    int status;                 // Raw wait status once the process is done
+    struct rusage usage;        // Valid once the process is done
+    struct timespec finished;
+};
+
+// A foreground or background command or pipeline. Entries are updated from
+// wait statuses the SIGCHLD handler queued; see drainChildEvents().
+struct Job {
+    int id;
+    pid_t pgid;
+    char *command;
+    struct JobProcess *processes;
+    int numProcesses;
+    enum JobState state;
+    int background;
+    struct timespec started;
+};
+
+// The SIGCHLD handler reaps children and queues their statuses here; the
+// shell applies them to the job table at safe points. Single producer
+// (the handler) and single consumer (the shell), so no locking is needed.
+struct ChildEvent {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    struct timespec when;
+};
+
+// Resources used by one finished job, summed over its processes
+struct JobUsage {
+    double wallSeconds;
+    struct rusage usage;
+};
+
+// Rolling per-command-name aggregates for the "stats" builtin
+struct CommandStats {
+    char *name;
+    unsigned long count;
+    double totalWall;
+    double totalUser;
+    double totalSys;
+    long peakRss;               // Kilobytes
+    double recentWall[STATS_WINDOW];
+    struct CommandStats *next;
+};
+
+// A command run side by side with others by "bookmark -i ... -j N" or
+// "parallel". Its stdout and stderr go to a memfd that is copied to the
+// terminal in one piece once it has finished.
+struct CapturedRun {
+    int index;                  // Which item of the batch this is
+    struct Job *job;            // NULL once finished
+    int outputFd;
+    int finished;
+    int printed;
+    int status;                 // Exit code, shell style
+    struct JobUsage usage;
+};
+
+// What runCapturedJobs needs to start and report each item of a batch
+struct CapturedBatch {
+    int count;
+    int limit;                  // Jobs running at once
+    int keepOrder;              // Print outputs in item order rather than as jobs finish
+    int haltOnFailure;          // Start nothing more after a failure
+    void (*start)(struct CapturedRun *run, int nullFd, void *context);
+    void (*header)(struct CapturedRun *run, void *context); // Optional line before each output
+    void *context;
+    int started;                // Set on return: items that were started
+};
+
+// "parallel" fills {} in the template with each item in turn
+struct ParallelCommand {
+    const char *commandPath;
+    char **words;
+    int numWords;
+    char **items;
+    int appendItem;             // No {} in the template, so the item goes last
+};
+
+// --serve wire format: every message is a ServeFrame header and length
+// bytes of payload. A request is any number of CWD, ENV ("NAME=value") and
+// FDS frames, then COMMAND (one or more lines). FDS carries the client's
+// stdout and stderr as SCM_RIGHTS; without it output comes back as STDOUT
+// and STDERR frames. EXIT (an int32 status) ends the reply.
+enum ServeFrameType {
+    SERVE_CWD = 1,
+    SERVE_ENV,
+    SERVE_FDS,
+    SERVE_COMMAND,
+    SERVE_STDOUT,
+    SERVE_STDERR,
+    SERVE_EXIT
+};
+
+struct ServeFrame {
+    uint32_t type;
+    uint32_t length;
+};
+
+struct ServeRequest {
+    char *command;
+    char *error;                // Set if the request cannot be run as sent
+    int fds[SERVE_MAX_FDS];
+    int numFds;
+};
+
+// Function declarations
+char *readLine(struct LineReader *reader, size_t *length);
+void *arenaAlloc(struct Arena *arena, size_t size);
+char *arenaStrdup(struct Arena *arena, const char *str);
+void arenaReset(struct Arena *arena);
+char **setup(char inputBuffer[], size_t length, int *background);
+void executeCommand(char *args[], int background, struct IORedirection *redirection);
+void launchExternalCommand(const char *commandPath, char *args[], int background, struct IORedirection *redirection);
+void walkSearchTree(struct SearchEngine *engine, const char *root, int recursive);
+int addSearchExtension(struct SearchFilter *filter, const char *ext, size_t len);
+void searchInFile(struct SearchTask *task, const struct SearchMatcher *matcher);
+const char *searchTaskPath(struct SearchTask *task);
+void releaseSearchDirFd(struct SearchDir *dir);
+void freeSearchTask(struct SearchTask *task);
+void runSearch(char *path, struct SearchMatcher *matcher, struct SearchOptions *options, struct FileList *files);
+void handleSearchCommand(char *args[]);
+void runIndexedSearch(char *path, struct SearchMatcher *matcher, struct SearchOptions *options);
+int handleInternalCommands(char *args[], struct IORedirection *redirection);
+int isBuiltinCommand(const char *name);
+void handleIOredirection(char *args[], struct IORedirection *redirection);
+void loadBookmarkStore();
+int writeOutput(int fd, const char *data, size_t len);
+void handleBookmarkCommand(char *args[]);
+void loadHistory();
+int isHistoryRecord(const struct HistoryRecord *record, size_t left);
+size_t nextHistoryRecord(struct HistoryStore *store, size_t from);
+void refreshHistory();
+void addHistory(const char *line, int status, time_t started, double seconds);
+int64_t findHistoryEntry(const char *text, uint32_t before, int prefix);
+const char *historyText(uint32_t entry);
+char *expandHistory(char *line, size_t *length);
+void handleHistoryCommand(char *args[]);
+void initTrie(struct Trie *trie);
+void freeTrie(struct Trie *trie);
+void insertTrieWord(struct Trie *trie, const char *word);
+void completeFromTrie(struct Trie *trie, const char *word, struct Completions *found);
+void initLineEditor(struct LineEditor *editor);
+char *editLine(struct LineEditor *editor, const char *prompt, size_t *length);
+void printBookmarks();
+void handleParallelCommand(char *args[]);
+char* trimQuotes(const char *str);
+const char *lookupCommandPath(const char *name);
+void resetCommandCache();
+void forgetRelativeCommandPaths();
+void warmCommandCache();
+void handleHashCommand(char *args[]);
+void handleWhichCommand(char *args[]);
+void handleLaunchCommand(char *args[]);
+int isPipeline(char *args[]);
+void runPipeline(char *args[], int background);
+void initJobControl();
+void drainChildEvents();
+void notifyFinishedJobs();
+void handleJobsCommand(char *args[]);
+void handleWaitCommand(char *args[]);
+void handleFgCommand(char *args[]);
+void handleBgCommand(char *args[]);
+void runCommand(char *args[], int background);
+void runCommandLines(struct LineReader *reader);
+void runServer(const char *path);
+int runClient(const char *path, char *argv[]);
+void recordCommandUsage(const char *name, double wallSeconds, struct rusage *usage);
+void handleTimeCommand(char *args[]);
+void handleStatsCommand(char *args[]);
+int compareDoubles(const void *a, const void *b);
+const char *findSubstring(const char *hay, size_t n, const char *needle, size_t m);
+void compileSearchMatcher(char **patterns, int numPatterns, struct SearchMatcher *matcher);
+void freeSearchMatcher(struct SearchMatcher *matcher);
+void searchBuffer(const char *buf, size_t len, const struct SearchMatcher *matcher, struct SearchTask *task);
+pid_t launchCommand(struct LaunchRequest *request);
+int searchUringSupported();
+#ifdef SEARCH_URING
+int openSearchRing(struct SearchRing *ring, unsigned entries);
+void closeSearchRing(struct SearchRing *ring);
+void searchBatchUring(struct SearchRing *ring, struct SearchTask **tasks, int count, const struct SearchMatcher *matcher);
+#endif
+
+// Shell state shared with the benchmark harness
+extern struct Arena commandArena;
+extern struct CommandCache commandCache;
+extern struct LaunchStats launchStats;
+extern int forceForkLaunch;
+extern struct HistoryStore historyStore;
+extern struct LineEditor lineEditor;
+extern int interactive;
+extern int lastStatus;
+
+#endif // OPSHELL_H